@@ -0,0 +1,104 @@
+// Size-bucketed pool of raw pixel buffers, so that programs reading
+// frame after frame of the same size stop going back to the heap.
+// To be used in Computer Vision class.
+
+#include "buffer_pool.h"
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+const size_t kMinBufferSize = 64;
+const size_t kCacheLineSize = 64;
+const size_t kPageSize = 4096;
+const size_t kHugePageSize = size_t(2) << 20;
+// Bytes kept per size (enough for a few frame sets of images in flight)
+// and over all sizes.
+const size_t kMaxCachedBytesPerSize = size_t(512) << 20;
+const size_t kMaxCachedBytes = size_t(1) << 30;
+
+size_t RoundUp(size_t bytes, size_t multiple) {
+  return (bytes + multiple - 1) / multiple * multiple;
+}
+
+size_t RoundedSize(size_t bytes) {
+  if (bytes > kHugePageSize) return RoundUp(bytes, kHugePageSize);
+  if (bytes > kPageSize) return RoundUp(bytes, kPageSize);
+  size_t size = kMinBufferSize;
+  while (size < bytes) size <<= 1;
+  return size;
+}
+
+void *AllocateAligned(size_t size) {
+  const size_t alignment = size >= kHugePageSize ? kHugePageSize :
+    kCacheLineSize;
+  void *buffer = nullptr;
+  if (posix_memalign(&buffer, alignment, size) != 0) abort();
+  return buffer;
+}
+
+}  // namespace
+
+BufferPool::~BufferPool() {
+  Trim();
+}
+
+BufferPool &BufferPool::Global() {
+  static BufferPool *pool = new BufferPool;
+  return *pool;
+}
+
+void *BufferPool::Acquire(size_t bytes) {
+  const size_t size = RoundedSize(bytes);
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto free_list = free_lists_.find(size);
+    if (free_list != free_lists_.end() && !free_list->second.empty()) {
+      void *buffer = free_list->second.back();
+      free_list->second.pop_back();
+      stats_.hits++;
+      stats_.cached_bytes -= size;
+      return buffer;
+    }
+    stats_.misses++;
+  }
+  return AllocateAligned(size);
+}
+
+void BufferPool::Release(void *buffer, size_t bytes) {
+  if (buffer == nullptr) return;
+  const size_t size = RoundedSize(bytes);
+  {
+    lock_guard<mutex> lock(mutex_);
+    vector<void *> &free_list = free_lists_[size];
+    if ((free_list.size() + 1) * size <= kMaxCachedBytesPerSize &&
+        stats_.cached_bytes + size <= kMaxCachedBytes) {
+      free_list.push_back(buffer);
+      stats_.cached_bytes += size;
+      return;
+    }
+  }
+  free(buffer);
+}
+
+void BufferPool::Trim() {
+  lock_guard<mutex> lock(mutex_);
+  for (auto &free_list : free_lists_)
+    for (void *buffer : free_list.second)
+      free(buffer);
+  free_lists_.clear();
+  stats_.cached_bytes = 0;
+}
+
+BufferPool::Stats BufferPool::GetStats() const {
+  lock_guard<mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace ComputerVisionProjects
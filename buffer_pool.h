@@ -0,0 +1,69 @@
+// Size-bucketed pool of raw pixel buffers, so that programs reading
+// frame after frame of the same size stop going back to the heap.
+// To be used in Computer Vision class.
+
+#ifndef COMPUTER_VISION_BUFFER_POOL_H_
+#define COMPUTER_VISION_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace ComputerVisionProjects {
+
+// Thread-safe free lists of buffers, one list per rounded size.
+// Requests are rounded up to a power of two (at least 64 bytes) up to
+// 4 KiB, to a multiple of 4 KiB up to 2 MiB, and to a multiple of 2 MiB
+// above that. Small buffers are aligned to a cache line; large ones to
+// 2 MiB so that, with transparent huge pages enabled system-wide, the
+// kernel can back them with huge pages. No madvise() is done: forcing
+// huge pages made row sweeps over large frames several times slower
+// on some hosts (see layout_bench).
+// Sample usage:
+//   BufferPool &pool = BufferPool::Global();
+//   void *buffer = pool.Acquire(bytes);
+//   ...
+//   pool.Release(buffer, bytes);  // Same bytes as in Acquire().
+class BufferPool {
+ public:
+  struct Stats {
+    size_t hits = 0;          // Acquire() calls served from a free list.
+    size_t misses = 0;        // Acquire() calls that went to the heap.
+    size_t cached_bytes = 0;  // Bytes sitting in the free lists now.
+  };
+
+  BufferPool() { }
+  BufferPool(const BufferPool &a_pool) = delete;
+  BufferPool& operator=(const BufferPool &a_pool) = delete;
+
+  ~BufferPool();
+
+  // The pool shared by every Image. Never destroyed, so images with
+  // static storage can still give their buffers back at exit.
+  static BufferPool &Global();
+
+  // Returns a buffer of at least bytes bytes (contents undefined).
+  // Aborts if the heap is exhausted.
+  void *Acquire(size_t bytes);
+
+  // Gives back a buffer from Acquire(bytes). The cache is capped in
+  // bytes, per size (512 MiB) and in total (1 GiB); past that the buffer
+  // goes back to the heap.
+  void Release(void *buffer, size_t bytes);
+
+  // Frees every cached buffer, e.g. when the frame size changes and the
+  // cached ones won't be asked for again.
+  void Trim();
+
+  Stats GetStats() const;
+
+ private:
+  std::map<size_t, std::vector<void *>> free_lists_;  // By rounded size.
+  Stats stats_;
+  mutable std::mutex mutex_;
+};
+
+}  // namespace ComputerVisionProjects
+
+#endif  // COMPUTER_VISION_BUFFER_POOL_H_
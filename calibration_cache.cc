@@ -0,0 +1,192 @@
+// Small binary cache for the results of the calibration steps (s1 and
+// s2), so they can be skipped when their inputs have not changed.
+// To be used in Computer Vision class.
+
+#include "calibration_cache.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace ComputerVisionProjects {
+
+namespace {
+
+const char kMagic[8] = {'P', 'S', 'C', 'A', 'L', '0', '0', '1'};
+const uint64_t kFnvOffset = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+template <typename T>
+bool ReadValue(FILE *input, T *value) {
+  return fread(value, sizeof(T), 1, input) == 1;
+}
+
+template <typename T>
+bool WriteValue(FILE *output, const T &value) {
+  return fwrite(&value, sizeof(T), 1, output) == 1;
+}
+
+bool ReadDoubles(FILE *input, vector<double> *values) {
+  int32_t count;
+  if (!ReadValue(input, &count) || count < 0) return false;
+  values->resize(count);
+  return count == 0 ||
+    fread(values->data(), sizeof(double), count, input) == size_t(count);
+}
+
+bool WriteDoubles(FILE *output, const vector<double> &values) {
+  const int32_t count = values.size();
+  return WriteValue(output, count) &&
+    (count == 0 ||
+     fwrite(values.data(), sizeof(double), count, output) == size_t(count));
+}
+
+}  // namespace
+
+bool Invert3x3(const double m[3][3], double inverse[3][3]) {
+  const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+    - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+    + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  if (fabs(det) < 1e-6) return false;
+  const double inv_det = 1.0 / det;
+  inverse[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+  inverse[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) * inv_det;
+  inverse[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+  inverse[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) * inv_det;
+  inverse[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+  inverse[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) * inv_det;
+  inverse[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+  inverse[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) * inv_det;
+  inverse[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+  return true;
+}
+
+bool ComputeLightInverse(const vector<double> &lights,
+			 vector<double> *inverse) {
+  if (inverse == nullptr) abort();
+  const int n = lights.size() / 3;
+  if (n < 3) return false;
+  inverse->assign(3 * n, 0.0);
+
+  if (n == 3) {
+    double S[3][3], S_inv[3][3];
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+	S[r][c] = lights[3 * r + c];
+    if (!Invert3x3(S, S_inv)) return false;
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+	(*inverse)[r * 3 + c] = S_inv[r][c];
+    return true;
+  }
+
+  double StS[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}}, StS_inv[3][3];
+  for (int k = 0; k < n; ++k)
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+	StS[r][c] += lights[3 * k + r] * lights[3 * k + c];
+  if (!Invert3x3(StS, StS_inv)) return false;
+  for (int r = 0; r < 3; ++r)
+    for (int k = 0; k < n; ++k)
+      (*inverse)[r * n + k] = StS_inv[r][0] * lights[3 * k] +
+	StS_inv[r][1] * lights[3 * k + 1] + StS_inv[r][2] * lights[3 * k + 2];
+  return true;
+}
+
+bool HashFile(const string &filename, uint64_t *hash) {
+  if (hash == nullptr) abort();
+  FILE *input = fopen(filename.c_str(), "rb");
+  if (input == 0) return false;
+
+  uint64_t h = kFnvOffset;
+  unsigned char buffer[1 << 16];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof buffer, input)) > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      h ^= buffer[i];
+      h *= kFnvPrime;
+    }
+  }
+  fclose(input);
+  *hash = h;
+  return true;
+}
+
+uint64_t CombineHash(uint64_t seed, uint64_t value) {
+  for (int i = 0; i < 8; ++i) {
+    seed ^= (value >> (8 * i)) & 0xff;
+    seed *= kFnvPrime;
+  }
+  return seed;
+}
+
+bool ReadCalibrationCache(const string &filename, CalibrationCache *cache) {
+  if (cache == nullptr) abort();
+  *cache = CalibrationCache();
+  FILE *input = fopen(filename.c_str(), "rb");
+  if (input == 0) return false;
+
+  char magic[sizeof kMagic];
+  CalibrationCache result;
+  uint8_t has_sphere, has_lights;
+  int32_t xbar, ybar, radius;
+  const bool ok =
+    fread(magic, 1, sizeof magic, input) == sizeof magic &&
+    memcmp(magic, kMagic, sizeof kMagic) == 0 &&
+    ReadValue(input, &has_sphere) &&
+    ReadValue(input, &result.sphere_key) &&
+    ReadValue(input, &xbar) &&
+    ReadValue(input, &ybar) &&
+    ReadValue(input, &radius) &&
+    ReadValue(input, &has_lights) &&
+    ReadValue(input, &result.lights_key) &&
+    ReadDoubles(input, &result.lights) &&
+    ReadDoubles(input, &result.inverse);
+  fclose(input);
+  if (!ok) return false;
+
+  result.has_sphere = has_sphere != 0;
+  result.xbar = xbar;
+  result.ybar = ybar;
+  result.radius = radius;
+  result.has_lights = has_lights != 0;
+  *cache = result;
+  return true;
+}
+
+bool WriteCalibrationCache(const string &filename,
+			   const CalibrationCache &cache) {
+  const string temp_filename =
+    filename + ".tmp." + to_string(static_cast<long>(getpid()));
+  FILE *output = fopen(temp_filename.c_str(), "wb");
+  if (output == 0) {
+    cout << "WriteCalibrationCache: cannot open file" << endl;
+    return false;
+  }
+
+  const bool ok =
+    fwrite(kMagic, 1, sizeof kMagic, output) == sizeof kMagic &&
+    WriteValue<uint8_t>(output, cache.has_sphere) &&
+    WriteValue(output, cache.sphere_key) &&
+    WriteValue<int32_t>(output, cache.xbar) &&
+    WriteValue<int32_t>(output, cache.ybar) &&
+    WriteValue<int32_t>(output, cache.radius) &&
+    WriteValue<uint8_t>(output, cache.has_lights) &&
+    WriteValue(output, cache.lights_key) &&
+    WriteDoubles(output, cache.lights) &&
+    WriteDoubles(output, cache.inverse);
+  if (fclose(output) != 0 || !ok ||
+      rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    cout << "WriteCalibrationCache: could not write" << endl;
+    remove(temp_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace ComputerVisionProjects
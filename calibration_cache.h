@@ -0,0 +1,79 @@
+// Small binary cache for the results of the calibration steps (s1 and
+// s2), so they can be skipped when their inputs have not changed.
+// To be used in Computer Vision class.
+
+#ifndef COMPUTER_VISION_CALIBRATION_CACHE_H_
+#define COMPUTER_VISION_CALIBRATION_CACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ComputerVisionProjects {
+
+// Everything the calibration produces, each part with the key of the
+// inputs it was computed from. Values are stored in full precision,
+// unlike parameters.txt / directions.txt.
+// Sample usage:
+//   CalibrationCache cache;
+//   ReadCalibrationCache("calibration.bin", &cache);  // OK if missing.
+//   if (cache.has_sphere && cache.sphere_key == key) { /* hit */ }
+//   ...
+//   WriteCalibrationCache("calibration.bin", cache);
+struct CalibrationCache {
+  // From s1: sphere centroid and radius, keyed by the sphere image and
+  // the threshold.
+  bool has_sphere = false;
+  uint64_t sphere_key = 0;
+  int xbar = 0;
+  int ybar = 0;
+  int radius = 0;
+
+  // From s2: one light source vector (x, y, z) per light, keyed by the
+  // sphere parameters and the sphere images.
+  bool has_lights = false;
+  uint64_t lights_key = 0;
+  std::vector<double> lights;  // num_lights x 3, row by row.
+
+  // The 3 x num_lights (pseudo-)inverse of the light matrix, row by row,
+  // written by s2 together with the lights (see ComputeLightInverse()).
+  std::vector<double> inverse;
+
+  int num_lights() const { return lights.size() / 3; }
+};
+
+// 64-bit FNV-1a hash of the bytes of file filename.
+// Returns true if everything is OK, false if the file can't be read.
+bool HashFile(const std::string &filename, uint64_t *hash);
+
+// Mixes value into a running hash (for keys built from several inputs).
+uint64_t CombineHash(uint64_t seed, uint64_t value);
+
+// Inverse of the 3x3 matrix m (row, column) by cofactors.
+// Returns false if m is (nearly) singular, |det| < 1e-6.
+bool Invert3x3(const double m[3][3], double inverse[3][3]);
+
+// Pseudo-inverse P of the num_lights x 3 light matrix S (lights, row by
+// row), so that N = P * I for any number of lights >= 3: S^-1 for 3
+// lights, (S^T S)^-1 S^T (least squares) for more. inverse is 3 x
+// num_lights, row by row.
+// Returns false if there are fewer than 3 lights or they are degenerate.
+bool ComputeLightInverse(const std::vector<double> &lights,
+			 std::vector<double> *inverse);
+
+// Reads a cache written by WriteCalibrationCache().
+// Returns true if everything is OK, false if the file is missing or is
+// not a calibration cache (cache is then left empty).
+bool ReadCalibrationCache(const std::string &filename,
+			  CalibrationCache *cache);
+
+// Writes cache into filename (native byte order). The data goes to a
+// temporary file that is then renamed over filename, so readers see
+// either the old or the new cache, never a partial one.
+// Returns true if everything is OK, false otherwise.
+bool WriteCalibrationCache(const std::string &filename,
+			   const CalibrationCache &cache);
+
+}  // namespace ComputerVisionProjects
+
+#endif  // COMPUTER_VISION_CALIBRATION_CACHE_H_
@@ -1,13 +1,25 @@
 // Class for representing a 2D gray-scale image,
-// with support for reading/writing pgm images.
+// with support for reading/writing pgm (and color ppm) images.
 // To be used in Computer Vision class.
 
 #include "image.h"
+#include "buffer_pool.h"
+#include <atomic>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -20,10 +32,8 @@ Image::Image(const Image &an_image){
   AllocateSpaceAndSetSize(an_image.num_rows(), an_image.num_columns());
   SetNumberGrayLevels(an_image.num_gray_levels());
 
-  for (size_t i = 0; i < num_rows(); ++i)
-    for (size_t j = 0; j < num_columns(); ++j){
-      SetPixel(i,j, an_image.GetPixel(i,j));
-    }
+  if (pixels_ != nullptr)
+    memcpy(pixels_, an_image.pixels_, num_rows_ * num_columns_ * sizeof(int));
 }
 
 Image::~Image(){
@@ -32,38 +42,157 @@ Image::~Image(){
 
 void Image::AllocateSpaceAndSetSize(size_t num_rows, size_t num_columns) {
   if (pixels_ != nullptr) DeallocateSpace();
-  pixels_ = new int*[num_rows];
-  for (size_t i = 0; i < num_rows; ++i)
-    pixels_[i] = new int[num_columns];
+  if (num_rows > 0 && num_columns > 0)
+    pixels_ = static_cast<int *>(
+      BufferPool::Global().Acquire(num_rows * num_columns * sizeof(int)));
 
   num_rows_ = num_rows;
   num_columns_ = num_columns;
 }
 
 void Image::DeallocateSpace() {
-  for (size_t i = 0; i < num_rows_; i++)
-    delete pixels_[i];
-  delete pixels_;
+  BufferPool::Global().Release(pixels_,
+			       num_rows_ * num_columns_ * sizeof(int));
   pixels_ = nullptr;
   num_rows_ = 0;
   num_columns_ = 0;
 }
 
-bool ReadImage(const string &filename, Image *an_image) {  
+void IntegralImage::Build(const Image &an_image, bool with_squares) {
+  num_rows_ = an_image.num_rows();
+  num_columns_ = an_image.num_columns();
+  const size_t stride = num_columns_ + 1;
+  sums_.assign((num_rows_ + 1) * stride, 0);
+  squares_.assign(with_squares ? sums_.size() : 0, 0);
+
+  // Runs body(begin, end) over [0, count) split across threads.
+  const size_t num_threads = max(1u, thread::hardware_concurrency());
+  auto parallel = [&](size_t count,
+		      const function<void(size_t, size_t)> &body) {
+    const size_t n = max<size_t>(1, min(num_threads, count));
+    const size_t chunk = (count + n - 1) / n;
+    vector<thread> pool;
+    for (size_t t = 1; t < n; ++t)
+      pool.emplace_back(body, min(count, t * chunk),
+			min(count, (t + 1) * chunk));
+    body(0, min(count, chunk));
+    for (thread &t : pool)
+      t.join();
+  };
+
+  // Pass 1: running sums along each row.
+  parallel(num_rows_, [&](size_t row_begin, size_t row_end) {
+    for (size_t i = row_begin; i < row_end; ++i) {
+      const int *pixels = an_image.GetRow(i);
+      long long *sum = &sums_[(i + 1) * stride];
+      long long *square =
+	with_squares ? &squares_[(i + 1) * stride] : nullptr;
+      long long running = 0, running_square = 0;
+      for (size_t j = 0; j < num_columns_; ++j) {
+	running += pixels[j];
+	sum[j + 1] = running;
+	if (square != nullptr) {
+	  running_square += (long long)pixels[j] * pixels[j];
+	  square[j + 1] = running_square;
+	}
+      }
+    }
+  });
+
+  // Pass 2: running sums down each column (threads own column ranges and
+  // walk the rows in order, so memory is still read row by row).
+  parallel(stride, [&](size_t col_begin, size_t col_end) {
+    for (size_t i = 1; i <= num_rows_; ++i) {
+      for (size_t j = col_begin; j < col_end; ++j) {
+	sums_[i * stride + j] += sums_[(i - 1) * stride + j];
+	if (with_squares)
+	  squares_[i * stride + j] += squares_[(i - 1) * stride + j];
+      }
+    }
+  });
+}
+
+const size_t TiledImage::kTileSize;
+
+TiledImage::~TiledImage() {
+  DeallocateSpace();
+}
+
+void TiledImage::AllocateSpaceAndSetSize(size_t num_rows,
+					 size_t num_columns) {
+  if (pixels_ != nullptr) DeallocateSpace();
+  num_rows_ = num_rows;
+  num_columns_ = num_columns;
+  num_tile_rows_ = (num_rows + kTileSize - 1) / kTileSize;
+  num_tile_columns_ = (num_columns + kTileSize - 1) / kTileSize;
+  const size_t num_pixels =
+    num_tile_rows_ * num_tile_columns_ * kTileSize * kTileSize;
+  if (num_pixels > 0)
+    pixels_ = static_cast<int *>(
+      BufferPool::Global().Acquire(num_pixels * sizeof(int)));
+}
+
+void TiledImage::DeallocateSpace() {
+  BufferPool::Global().Release(pixels_, num_tile_rows_ * num_tile_columns_ *
+			       kTileSize * kTileSize * sizeof(int));
+  pixels_ = nullptr;
+  num_rows_ = num_columns_ = 0;
+  num_tile_rows_ = num_tile_columns_ = 0;
+}
+
+// Every tile row of the image is kTileSize image rows; each image row
+// is cut into the tiles' row segments with plain copies.
+void ConvertToTiled(const Image &an_image, TiledImage *tiled) {
+  if (tiled == nullptr) abort();
+  const size_t kTileSize = TiledImage::kTileSize;
+  tiled->AllocateSpaceAndSetSize(an_image.num_rows(), an_image.num_columns());
+  tiled->SetNumberGrayLevels(an_image.num_gray_levels());
+
+  for (size_t i = 0; i < an_image.num_rows(); ++i) {
+    const int *row = an_image.GetRow(i);
+    for (size_t tj = 0; tj < tiled->num_tile_columns(); ++tj)
+      memcpy(tiled->GetTile(i / kTileSize, tj) + (i % kTileSize) * kTileSize,
+	     row + tj * kTileSize, tiled->TileWidth(tj) * sizeof(int));
+  }
+}
+
+void ConvertToRowMajor(const TiledImage &tiled, Image *an_image) {
   if (an_image == nullptr) abort();
+  const size_t kTileSize = TiledImage::kTileSize;
+  an_image->AllocateSpaceAndSetSize(tiled.num_rows(), tiled.num_columns());
+  an_image->SetNumberGrayLevels(tiled.num_gray_levels());
+
+  for (size_t i = 0; i < tiled.num_rows(); ++i) {
+    int *row = an_image->GetRow(i);
+    for (size_t tj = 0; tj < tiled.num_tile_columns(); ++tj)
+      memcpy(row + tj * kTileSize,
+	     tiled.GetTile(i / kTileSize, tj) + (i % kTileSize) * kTileSize,
+	     tiled.TileWidth(tj) * sizeof(int));
+  }
+}
+
+// Opens a pgm (P5, or ASCII P2) or ppm (P6, or ASCII P3) file and reads
+// its header, leaving input at the first pixel. *channels is 1 for pgm
+// and 3 for ppm. Error messages are prefixed with caller.
+static FILE *OpenAndReadHeader(const string &filename, const char *caller,
+			       int *channels, bool *ascii, int *num_rows,
+			       int *num_columns, int *levels) {
   FILE *input = fopen(filename.c_str(),"rb");
   if (input == 0) {
-    cout << "ReadImage: Cannot open file" << endl;
-    return false;
+    cout << caller << ": Cannot open file" << endl;
+    return nullptr;
   }
   
   // Check for the right "magic number".
   char line[1024];
-  if (fread(line, 1, 3, input) != 3 || strncmp(line,"P5\n",3)) {
+  if (fread(line, 1, 3, input) != 3 || line[0] != 'P' || line[2] != '\n' ||
+      !strchr("2356", line[1])) {
     fclose(input);
-    cout << "ReadImage: Expected .pgm file" << endl;
-    return false;
+    cout << caller << ": Expected .pgm or .ppm file" << endl;
+    return nullptr;
   }
+  *channels = (line[1] == '3' || line[1] == '6') ? 3 : 1;
+  *ascii = line[1] == '2' || line[1] == '3';
   
   // Skip comments.
   do
@@ -71,36 +200,227 @@ bool ReadImage(const string &filename, Image *an_image) {
   while(*line == '#');
   
   // Read the width and height.
-  int num_columns,num_rows;
-  sscanf(line,"%d %d\n", &num_columns, &num_rows);
-  an_image->AllocateSpaceAndSetSize(num_rows, num_columns);
-  
+  sscanf(line,"%d %d\n", num_columns, num_rows);
 
   // Read # of gray levels.
   fgets(line, sizeof line, input);
-  int levels;
-  sscanf(line,"%d\n", &levels);
-  an_image->SetNumberGrayLevels(levels);
+  sscanf(line,"%d\n", levels);
+  return input;
+}
+
+// Decodes count big-endian 16-bit samples (maxval > 255) from bytes.
+static void DecodeBigEndian16(const unsigned char *bytes, size_t count,
+			      int *samples) {
+  size_t i = 0;
+#ifdef __SSE2__
+  // 8 samples at a time: swap the bytes of each 16-bit lane, then widen.
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(bytes + 2 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(samples + i), _mm_unpacklo_epi16(v, zero));
+    _mm_storeu_si128((__m128i *)(samples + i + 4),
+		     _mm_unpackhi_epi16(v, zero));
+  }
+#endif
+  for (; i < count; ++i)
+    samples[i] = (bytes[2 * i] << 8) | bytes[2 * i + 1];
+}
 
-  // read pixel row by row.
+// Reads the interleaved pixels that follow the header into one plane per
+// channel (planes[0..channels-1] are allocated here). Samples are one
+// byte, or two big-endian bytes when levels > 255, or ASCII numbers.
+static bool ReadPlanes(FILE *input, const char *caller, int channels,
+		       bool ascii, int num_rows, int num_columns, int levels,
+		       Image *planes[]) {
+  for (int c = 0; c < channels; ++c) {
+    planes[c]->AllocateSpaceAndSetSize(num_rows, num_columns);
+    planes[c]->SetNumberGrayLevels(levels);
+  }
+
+  // read pixel row by row; gray rows decode straight into the image.
+  const size_t num_samples = size_t(num_columns) * channels;
+  const size_t bytes_per_sample = levels > 255 ? 2 : 1;
+  vector<unsigned char> bytes(ascii ? 0 : num_samples * bytes_per_sample);
+  vector<int> interleaved(channels == 1 ? 0 : num_samples);
   for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0;j < num_columns; ++j) {
-      const int byte=fgetc(input);
-      if (byte == EOF) {
-        fclose(input);
-        cout << "ReadImage: short file" << endl;
-        return false;
+    int *samples = channels == 1 ? planes[0]->GetRow(i) : interleaved.data();
+    if (ascii) {
+      for (size_t s = 0; s < num_samples; ++s) {
+	if (fscanf(input, "%d", &samples[s]) != 1) {
+	  cout << caller << ": short file" << endl;
+	  return false;
+	}
+      }
+    } else {
+      if (fread(bytes.data(), 1, bytes.size(), input) != bytes.size()) {
+	cout << caller << ": short file" << endl;
+	return false;
       }
-      an_image->SetPixel(i, j, byte);
+      if (bytes_per_sample == 2) {
+	DecodeBigEndian16(bytes.data(), num_samples, samples);
+      } else {
+	for (size_t s = 0; s < num_samples; ++s)
+	  samples[s] = bytes[s];
+      }
+    }
+    if (channels != 1) {
+      for (int j = 0; j < num_columns; ++j)
+	for (int c = 0; c < channels; ++c)
+	  planes[c]->SetPixel(i, j, samples[size_t(j) * channels + c]);
     }
   }
-  
+  return true;
+}
+
+// Writes count samples as one byte each, or two big-endian bytes when
+// levels > 255.
+static bool WriteSamples(FILE *output, const int *samples, size_t count,
+			 int levels) {
+  if (levels <= 255) {
+    vector<unsigned char> bytes(samples, samples + count);
+    return fwrite(bytes.data(), 1, count, output) == count;
+  }
+  vector<unsigned char> bytes(2 * count);
+  for (size_t s = 0; s < count; ++s) {
+    bytes[2 * s] = samples[s] >> 8;
+    bytes[2 * s + 1] = samples[s];
+  }
+  return fwrite(bytes.data(), 1, bytes.size(), output) == bytes.size();
+}
+
+bool ReadImage(const string &filename, Image *an_image) {  
+  if (an_image == nullptr) abort();
+  int channels, num_rows, num_columns, levels;
+  bool ascii;
+  FILE *input = OpenAndReadHeader(filename, "ReadImage", &channels, &ascii,
+				  &num_rows, &num_columns, &levels);
+  if (input == nullptr) return false;
+
+  bool ok;
+  if (channels == 1) {
+    Image *planes[] = {an_image};
+    ok = ReadPlanes(input, "ReadImage", 1, ascii, num_rows, num_columns, levels,
+		    planes);
+  } else {
+    // Color file: keep the luminance.
+    Image red, green, blue;
+    Image *planes[] = {&red, &green, &blue};
+    ok = ReadPlanes(input, "ReadImage", 3, ascii, num_rows, num_columns, levels,
+		    planes);
+    if (ok) ConvertToGray(red, green, blue, an_image);
+  }
+
   fclose(input);
-  return true; 
+  return ok; 
+}
+
+bool ReadColorImage(const string &filename, Image *red, Image *green,
+		    Image *blue) {
+  if (red == nullptr || green == nullptr || blue == nullptr) abort();
+  int channels, num_rows, num_columns, levels;
+  bool ascii;
+  FILE *input = OpenAndReadHeader(filename, "ReadColorImage", &channels,
+				  &ascii, &num_rows, &num_columns, &levels);
+  if (input == nullptr) return false;
+
+  Image *planes[] = {red, green, blue};
+  const bool ok = ReadPlanes(input, "ReadColorImage", channels, ascii,
+			     num_rows, num_columns, levels, planes);
+  fclose(input);
+  if (!ok) return false;
+
+  // Gray file: same plane in all three channels.
+  if (channels == 1) {
+    for (Image *plane : {green, blue}) {
+      plane->AllocateSpaceAndSetSize(num_rows, num_columns);
+      plane->SetNumberGrayLevels(levels);
+      for (int i = 0; i < num_rows; ++i)
+	for (int j = 0; j < num_columns; ++j)
+	  plane->SetPixel(i, j, red->GetPixel(i, j));
+    }
+  }
+  return true;
+}
+
+void ConvertToGray(const Image &red, const Image &green, const Image &blue,
+		   Image *gray) {
+  if (gray == nullptr) abort();
+  gray->AllocateSpaceAndSetSize(red.num_rows(), red.num_columns());
+  gray->SetNumberGrayLevels(red.num_gray_levels());
+  // ITU-R BT.601 luma weights in 8-bit fixed point (77 + 150 + 29 = 256).
+  for (size_t i = 0; i < red.num_rows(); ++i)
+    for (size_t j = 0; j < red.num_columns(); ++j)
+      gray->SetPixel(i, j, (77 * red.GetPixel(i, j) +
+			    150 * green.GetPixel(i, j) +
+			    29 * blue.GetPixel(i, j) + 128) >> 8);
+}
+
+// Runs read(i) for every file on a small pool of I/O threads, after
+// asking the OS to start reading ahead on all of them.
+static bool ReadInParallel(const vector<string> &filenames,
+			   const function<bool(size_t)> &read,
+			   size_t *failed_index) {
+  // Kick off readahead on every file before decoding any of them.
+  // WILLNEED starts filling the page cache, which outlives the fd; hints
+  // on how the fd itself is read would not reach the later fopen().
+#ifdef POSIX_FADV_WILLNEED
+  for (const string &filename : filenames) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) continue;  // read() below reports it.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+#endif
+
+  // Small pool: each thread keeps taking the next unread file.
+  const size_t kMaxIoThreads = 4;
+  const size_t num_threads = min(kMaxIoThreads, filenames.size());
+  atomic<size_t> next{0};
+  atomic<size_t> failed{filenames.size()};
+  auto worker = [&]() {
+    for (size_t i = next++; i < filenames.size(); i = next++) {
+      if (!read(i)) failed = i;
+    }
+  };
+
+  vector<thread> pool;
+  for (size_t t = 1; t < num_threads; ++t)
+    pool.emplace_back(worker);
+  worker();
+  for (thread &t : pool)
+    t.join();
+
+  if (failed < filenames.size()) {
+    if (failed_index != nullptr) *failed_index = failed;
+    return false;
+  }
+  return true;
+}
+
+bool ReadImages(const vector<string> &filenames, vector<Image> *images,
+		size_t *failed_index) {
+  if (images == nullptr) abort();
+  images->clear();
+  images->resize(filenames.size());
+  return ReadInParallel(filenames, [&](size_t i) {
+      return ReadImage(filenames[i], &(*images)[i]);
+    }, failed_index);
+}
+
+bool ReadColorImages(const vector<string> &filenames, vector<Image> *planes,
+		     size_t *failed_index) {
+  if (planes == nullptr) abort();
+  planes->clear();
+  planes->resize(3 * filenames.size());
+  return ReadInParallel(filenames, [&](size_t i) {
+      return ReadColorImage(filenames[i], &(*planes)[3 * i],
+			    &(*planes)[3 * i + 1], &(*planes)[3 * i + 2]);
+    }, failed_index);
 }
 
 bool WriteImage(const string &filename, const Image &an_image) {  
-  FILE *output = fopen(filename.c_str(), "w");
+  FILE *output = fopen(filename.c_str(), "wb");
   if (output == 0) {
     cout << "WriteImage: cannot open file" << endl;
     return false;
@@ -112,16 +432,13 @@ bool WriteImage(const string &filename, const Image &an_image) {
   // Write the header.
   fprintf(output, "P5\n"); // Magic number.
   fprintf(output, "#\n");  // Empty comment.
-  fprintf(output, "%d %d\n%03d\n", num_columns, num_rows, colors);
+  fprintf(output, "%d %d\n%d\n", num_columns, num_rows, colors);
 
   for (int i = 0; i < num_rows; ++i) {
-    for (int j = 0; j < num_columns; ++j) {
-      const int byte = an_image.GetPixel(i , j);
-      if (fputc(byte,output) == EOF) {
-	    fclose(output);
-            cout << "WriteImage: could not write" << endl;
-	    return false;
-      }
+    if (!WriteSamples(output, an_image.GetRow(i), num_columns, colors)) {
+      fclose(output);
+      cout << "WriteImage: could not write" << endl;
+      return false;
     }
   }
 
@@ -129,158 +446,359 @@ bool WriteImage(const string &filename, const Image &an_image) {
   return true; 
 }
 
-// Implements the Bresenham's incremental midpoint algorithm;
-// (adapted from J.D.Foley, A. van Dam, S.K.Feiner, J.F.Hughes
-// "Computer Graphics. Principles and practice", 
-// 2nd ed., 1990, section 3.2.2);  
-void DrawLine(int x0, int y0, int x1, int y1, int color,
-	      Image *an_image) {  
-  if (an_image == nullptr) abort();
+bool WriteColorImage(const string &filename, const Image &red,
+		     const Image &green, const Image &blue) {
+  FILE *output = fopen(filename.c_str(), "wb");
+  if (output == 0) {
+    cout << "WriteColorImage: cannot open file" << endl;
+    return false;
+  }
+  const int num_rows = red.num_rows();
+  const int num_columns = red.num_columns();
+  const int colors = red.num_gray_levels();
+
+  // Write the header.
+  fprintf(output, "P6\n"); // Magic number.
+  fprintf(output, "#\n");  // Empty comment.
+  fprintf(output, "%d %d\n%d\n", num_columns, num_rows, colors);
 
-#ifdef SWAP
-#undef SWAP
+  // Interleave one row at a time.
+  vector<int> row(size_t(num_columns) * 3);
+  for (int i = 0; i < num_rows; ++i) {
+    for (int j = 0; j < num_columns; ++j) {
+      row[3 * j] = red.GetPixel(i, j);
+      row[3 * j + 1] = green.GetPixel(i, j);
+      row[3 * j + 2] = blue.GetPixel(i, j);
+    }
+    if (!WriteSamples(output, row.data(), row.size(), colors)) {
+      fclose(output);
+      cout << "WriteColorImage: could not write" << endl;
+      return false;
+    }
+  }
+
+  fclose(output);
+  return true; 
+}
+
+// One output row of Downsample2x() from input rows top and bottom.
+static void DownsampleRow(const int *top, const int *bottom, int *out,
+			  size_t num_columns) {
+  size_t j = 0;
+#ifdef __SSE2__
+  // 4 output pixels (8 input columns) at a time: add the two rows,
+  // then add even and odd columns, then round and divide by 4.
+  const __m128i two = _mm_set1_epi32(2);
+  for (; j + 4 <= num_columns; j += 4) {
+    const __m128i v0 = _mm_add_epi32(
+	_mm_loadu_si128((const __m128i *)(top + 2 * j)),
+	_mm_loadu_si128((const __m128i *)(bottom + 2 * j)));
+    const __m128i v1 = _mm_add_epi32(
+	_mm_loadu_si128((const __m128i *)(top + 2 * j + 4)),
+	_mm_loadu_si128((const __m128i *)(bottom + 2 * j + 4)));
+    const __m128 f0 = _mm_castsi128_ps(v0);
+    const __m128 f1 = _mm_castsi128_ps(v1);
+    const __m128i even =
+      _mm_castps_si128(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i odd =
+      _mm_castps_si128(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(3, 1, 3, 1)));
+    const __m128i sum = _mm_add_epi32(_mm_add_epi32(even, odd), two);
+    _mm_storeu_si128((__m128i *)(out + j), _mm_srai_epi32(sum, 2));
+  }
 #endif
-#define SWAP(a,b) {a^=b; b^=a; a^=b;}
+  for (; j < num_columns; ++j)
+    out[j] = (top[2 * j] + top[2 * j + 1] +
+	      bottom[2 * j] + bottom[2 * j + 1] + 2) >> 2;
+}
 
-  const int DIR_X = 0;
-  const int DIR_Y = 1;
-  
-  // Increments: East, North-East, South, South-East, North.
-  int incrE,
-    incrNE,
-    incrS,
-    incrSE,
-    incrN;     
-  int d;         /* the D */
-  int x,y;       /* running coordinates */
-  int mpCase;    /* midpoint algorithm's case */
-  int done;      /* set to 1 when done */
-  
-  int xmin = x0;
-  int xmax = x1;
-  int ymin = y0;
-  int ymax = y1;
-  
-  int dx = xmax - xmin;
-  int dy = ymax - ymin;
-  int dir;
-
-  if (dx * dx > dy * dy) {  // Horizontal scan.
-    dir=DIR_X;
-    if (xmax < xmin) {
-      SWAP(xmin, xmax);
-      SWAP(ymin , ymax);
-    } 
-    dx = xmax - xmin;
-    dy = ymax - ymin;
-
-    if (dy >= 0) {
-      mpCase = 1;
-      d = 2 * dy - dx;      
-    } else {
-      mpCase = 2;
-      d = 2 * dy + dx;      
+void Downsample2x(const Image &an_image, Image *half) {
+  if (half == nullptr || half == &an_image) abort();
+  const size_t num_rows = an_image.num_rows() / 2;
+  const size_t num_columns = an_image.num_columns() / 2;
+  half->AllocateSpaceAndSetSize(num_rows, num_columns);
+  half->SetNumberGrayLevels(an_image.num_gray_levels());
+
+  for (size_t i = 0; i < num_rows; ++i)
+    DownsampleRow(an_image.GetRow(2 * i), an_image.GetRow(2 * i + 1),
+		  half->GetRow(i), num_columns);
+}
+
+void Downsample2x(const TiledImage &an_image, TiledImage *half) {
+  if (half == nullptr || half == &an_image) abort();
+  const size_t kTileSize = TiledImage::kTileSize;
+  half->AllocateSpaceAndSetSize(an_image.num_rows() / 2,
+				an_image.num_columns() / 2);
+  half->SetNumberGrayLevels(an_image.num_gray_levels());
+
+  // Input tile (ti, tj) lands in quadrant (ti % 2, tj % 2) of output
+  // tile (ti / 2, tj / 2); an odd last row or column is dropped.
+  for (size_t ti = 0; ti < an_image.num_tile_rows(); ++ti) {
+    const size_t num_rows = an_image.TileHeight(ti) / 2;
+    for (size_t tj = 0; tj < an_image.num_tile_columns(); ++tj) {
+      const size_t num_columns = an_image.TileWidth(tj) / 2;
+      if (num_rows == 0 || num_columns == 0) continue;
+      const int *tile = an_image.GetTile(ti, tj);
+      int *out = half->GetTile(ti / 2, tj / 2) +
+	(ti % 2) * (kTileSize / 2) * kTileSize + (tj % 2) * (kTileSize / 2);
+      for (size_t i = 0; i < num_rows; ++i)
+	DownsampleRow(tile + 2 * i * kTileSize, tile + (2 * i + 1) * kTileSize,
+		      out + i * kTileSize, num_columns);
     }
+  }
+}
 
-    incrNE = 2 * (dy - dx);
-    incrE = 2 * dy;
-    incrSE = 2 * (dy + dx);
-  } else {// vertical scan.
-    dir = DIR_Y;
-    if (ymax < ymin) {
-      SWAP(xmin, xmax);
-      SWAP(ymin, ymax);
+void BuildPyramid(const Image &an_image, int num_levels,
+		  vector<Image> *pyramid) {
+  if (pyramid == nullptr) abort();
+  pyramid->clear();
+  pyramid->resize(num_levels);
+  for (int level = 0; level < num_levels; ++level) {
+    const Image &finer = level == 0 ? an_image : (*pyramid)[level - 1];
+    Downsample2x(finer, &(*pyramid)[level]);
+  }
+}
+
+// Cohen-Sutherland outcode of (x, y) against rows [row_begin, row_end)
+// and columns [0, num_columns).
+static int OutCode(int x, int y, int row_begin, int row_end,
+		   int num_columns) {
+  const int kAbove = 1, kBelow = 2, kLeft = 4, kRight = 8;
+  return (x < row_begin ? kAbove : 0) | (x >= row_end ? kBelow : 0) |
+    (y < 0 ? kLeft : 0) | (y >= num_columns ? kRight : 0);
+}
+
+// Rounds a / b down and up, for b > 0 and any sign of a.
+static long long FloorDiv(long long a, long long b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+static long long CeilDiv(long long a, long long b) {
+  return -FloorDiv(-a, b);
+}
+
+// Offset h so that floor((2 t minor_length + h) / (2 major_length)) is
+// t * minor_length / major_length rounded to the nearest integer, with
+// halves going to the smaller minor coordinate (as the midpoint
+// DrawLine always did): down when the minor axis counts up, up when it
+// counts down.
+static long long RoundingOffset(int major_length, int minor_sign) {
+  return minor_sign > 0 ? max(major_length - 1, 0) : major_length;
+}
+
+// Steps t = 0..major_length whose major coordinate major0 + major_sign * t
+// lies in [major_min, major_max], in [*t_begin, *t_end].
+static void ClipMajor(int major0, int major_sign, int major_length,
+		      int major_min, int major_max,
+		      long long *t_begin, long long *t_end) {
+  // t is just a distance.
+  *t_begin = 0;
+  *t_end = major_length;
+  if (major_sign > 0) {
+    *t_begin = max(*t_begin, (long long)major_min - major0);
+    *t_end = min(*t_end, (long long)major_max - major0);
+  } else {
+    *t_begin = max(*t_begin, (long long)major0 - major_max);
+    *t_end = min(*t_end, (long long)major0 - major_min);
+  }
+}
+
+// Steps t = 0..major_length along the major axis of a line. At step t the
+// minor axis has moved m(t) = round(t * minor_length / major_length)
+// (halves as in RoundingOffset()), i.e. Bresenham's line, so m(t) has a
+// closed form and the walk can start at any t. Returns in
+// [*t_begin, *t_end] the steps whose major coordinate
+// major0 + major_sign * t lies in [major_min, major_max] and whose minor
+// coordinate minor0 + minor_sign * m(t) lies in [minor_min, minor_max].
+static void ClipSteps(int major0, int major_sign, int major_length,
+		      int major_min, int major_max,
+		      int minor0, int minor_sign, int minor_length,
+		      int minor_min, int minor_max,
+		      long long *t_begin, long long *t_end) {
+  long long lo, hi;
+  ClipMajor(major0, major_sign, major_length, major_min, major_max, &lo, &hi);
+
+  // Minor axis: range of m, then of t through the closed form of m(t).
+  const long long m_min =
+    minor_sign > 0 ? minor_min - minor0 : minor0 - minor_max;
+  const long long m_max =
+    minor_sign > 0 ? minor_max - minor0 : minor0 - minor_min;
+  if (minor_length == 0) {
+    if (m_min > 0 || m_max < 0) hi = lo - 1;
+  } else {
+    const long long two_major = 2LL * major_length;
+    const long long two_minor = 2LL * minor_length;
+    const long long offset = RoundingOffset(major_length, minor_sign);
+    // m(t) >= m_min  <=>  2 t minor + offset >= 2 major m_min
+    lo = max(lo, CeilDiv(two_major * m_min - offset, two_minor));
+    // m(t) <= m_max  <=>  2 t minor + offset < 2 major (m_max + 1)
+    hi = min(hi, FloorDiv(two_major * (m_max + 1) - offset - 1,
+			  two_minor));
+  }
+  *t_begin = lo;
+  *t_end = hi;
+}
+
+// Minor coordinate of LineRounding::kFloatSteps before rounding: minor0
+// with increment added t times in float. Float rounding decides which
+// way the exact halves go, so this is replayed rather than multiplied.
+static float FloatStepValue(int minor0, float increment, long long t) {
+  float value = minor0;
+  for (long long k = 0; k < t; ++k)
+    value += increment;
+  return value;
+}
+
+// ClipSteps() for LineRounding::kFloatSteps. The rounded minor coordinate
+// never turns back, so its range is found by bisection.
+static void ClipFloatSteps(int major0, int major_sign, int major_length,
+			   int major_min, int major_max,
+			   int minor0, float increment,
+			   int minor_min, int minor_max,
+			   long long *t_begin, long long *t_end) {
+  long long lo, hi;
+  ClipMajor(major0, major_sign, major_length, major_min, major_max, &lo, &hi);
+  auto coordinate = [&](long long t) {
+    return round(FloatStepValue(minor0, increment, t));
+  };
+  // First t in [a, b] for which past(t) holds, b + 1 if none; past() is
+  // false up to some t and true from there.
+  auto first_past = [](long long a, long long b,
+		       const function<bool(long long)> &past) {
+    while (a <= b) {
+      const long long mid = a + (b - a) / 2;
+      if (past(mid)) b = mid - 1;
+      else a = mid + 1;
     }
-    dx = xmax - xmin;
-    dy = ymax-ymin;    
+    return a;
+  };
+  if (increment >= 0) {
+    *t_begin = first_past(lo, hi, [&](long long t) {
+	return coordinate(t) >= minor_min; });
+    *t_end = first_past(*t_begin, hi, [&](long long t) {
+	return coordinate(t) > minor_max; }) - 1;
+  } else {
+    *t_begin = first_past(lo, hi, [&](long long t) {
+	return coordinate(t) <= minor_max; });
+    *t_end = first_past(*t_begin, hi, [&](long long t) {
+	return coordinate(t) < minor_min; }) - 1;
+  }
+}
 
-    if (dx >=0 ) {
-      mpCase = 1;
-      d = 2 * dx - dy;      
+// Draws the part of the line inside rows [row_begin, row_end), writing
+// straight into the row buffers. The pixels drawn are the same whatever
+// the row range, so a line split across row bands matches one drawn whole.
+static void DrawLineInRows(int x0, int y0, int x1, int y1, int color,
+			   LineRounding rounding, int row_begin, int row_end,
+			   Image *an_image) {
+  const int num_columns = an_image->num_columns();
+  row_begin = max(row_begin, 0);
+  row_end = min(row_end, int(an_image->num_rows()));
+  if (row_begin >= row_end) return;
+
+  // Trivial reject: both ends on the same outside side.
+  if (OutCode(x0, y0, row_begin, row_end, num_columns) &
+      OutCode(x1, y1, row_begin, row_end, num_columns))
+    return;
+
+  const int dx = abs(x1 - x0), dy = abs(y1 - y0);
+  const int sx = x1 >= x0 ? 1 : -1, sy = y1 >= y0 ? 1 : -1;
+  const bool x_major = dx >= dy;
+  const int major_length = x_major ? dx : dy;
+  const int minor_length = x_major ? dy : dx;
+  int *pixels = an_image->GetRow(0);
+
+  long long t_begin, t_end;
+  if (rounding == LineRounding::kFloatSteps) {
+    const int minor0 = x_major ? y0 : x0;
+    const float increment = float(x_major ? y1 - y0 : x1 - x0) /
+      float(max(major_length, 1));
+    if (x_major) {
+      ClipFloatSteps(x0, sx, dx, row_begin, row_end - 1,
+		     y0, increment, 0, num_columns - 1, &t_begin, &t_end);
     } else {
-      mpCase = 2;
-      d = 2 * dx + dy;      
+      ClipFloatSteps(y0, sy, dy, 0, num_columns - 1,
+		     x0, increment, row_begin, row_end - 1, &t_begin, &t_end);
     }
-
-    incrNE = 2 * (dx - dy);
-    incrE = 2 * dx;
-    incrSE = 2 * (dx + dy);
+    // Every step of [t_begin, t_end] is inside.
+    float minor = FloatStepValue(minor0, increment, t_begin);
+    long long major = x_major ? x0 + sx * t_begin : y0 + sy * t_begin;
+    const int major_sign = x_major ? sx : sy;
+    for (long long t = t_begin; t <= t_end; ++t) {
+      const long long m = (long long)round(minor);
+      pixels[x_major ? major * num_columns + m : m * num_columns + major] =
+	color;
+      major += major_sign;
+      minor += increment;
+    }
+    return;
   }
-  
-  /// Start the scan.
-  x = xmin;
-  y = ymin;
-  done = 0;
 
-  while (!done) {
-    an_image->SetPixel(x,y,color);
-  
-    // Move to the next point.
-    switch(dir) {
-    case DIR_X: 
-      if (x < xmax) {
-	      switch(mpCase) {
-	      case 1:
-		if (d <= 0) {
-		  d += incrE;  
-		  x++;
-		} else {
-		  d += incrNE; 
-		  x++; 
-		  y++;
-		}
-		break;
-  
-            case 2:
-              if (d <= 0) {
-                d += incrSE; 
-		x++; 
-		y--;
-              } else {
-                d += incrE;  
-		x++;
-              }
-	      break;
-	      } 
-      } else {
-	done=1;
-      }     
-      break;
-
-    case DIR_Y: 
-        if (y < ymax) {
-          switch(mpCase) {
-	  case 1:
-	    if (d <= 0) {
-	      d += incrE;  
-	      y++;
-	    } else {
-	      d += incrNE; 
-	      y++; 
-	      x++;
-	    }
-            break;
-  
-	  case 2:
-	    if (d <= 0) {
-                d += incrSE; 
-		y++; 
-		x--;
-              } else {
-                d += incrE;  
-		y++;
-	    }
-            break;
-	  } // mpCase
-        } // y < ymin 
-        else {
-	  done=1;
-	}
-	break;    
+  if (x_major) {
+    ClipSteps(x0, sx, dx, row_begin, row_end - 1,
+	      y0, sy, dy, 0, num_columns - 1, &t_begin, &t_end);
+  } else {
+    ClipSteps(y0, sy, dy, 0, num_columns - 1,
+	      x0, sx, dx, row_begin, row_end - 1, &t_begin, &t_end);
+  }
+  if (t_begin > t_end) return;
+
+  // Bresenham from t_begin: m and its remainder come from the closed form.
+  const long long two_major = 2LL * max(major_length, 1);
+  const long long numerator = 2LL * t_begin * minor_length +
+    RoundingOffset(major_length, x_major ? sy : sx);
+  const long long m = numerator / two_major;
+  long long remainder = numerator - m * two_major;
+
+  // Every step of [t_begin, t_end] is inside, so walk a flat offset.
+  const long long x = x_major ? x0 + sx * t_begin : x0 + sx * m;
+  const long long y = x_major ? y0 + sy * m : y0 + sy * t_begin;
+  const long long major_step = x_major ? sx * num_columns : sy;
+  const long long minor_step = x_major ? sy : sx * num_columns;
+  long long offset = x * num_columns + y;
+  for (long long t = t_begin; t <= t_end; ++t) {
+    pixels[offset] = color;
+    offset += major_step;
+    remainder += 2LL * minor_length;
+    if (remainder >= two_major) {
+      remainder -= two_major;
+      offset += minor_step;
     }
   }
 }
 
+// Bresenham's line, with the midpoint algorithm's choice at exact
+// halves; the segment is clipped to the image once, then drawn without
+// per-pixel checks.
+void DrawLine(int x0, int y0, int x1, int y1, int color,
+	      Image *an_image) {  
+  if (an_image == nullptr) abort();
+  DrawLineInRows(x0, y0, x1, y1, color, LineRounding::kMidpoint, 0,
+		 an_image->num_rows(), an_image);
+}
+
+void DrawLines(const vector<LineSegment> &segments, Image *an_image) {
+  if (an_image == nullptr) abort();
+  const int num_rows = an_image->num_rows();
+
+  // Each thread owns a band of rows and draws every segment (in order)
+  // clipped to it, so no two threads write the same pixel.
+  const int kMinRowsPerBand = 32;
+  const int num_threads = max(1, min<int>(thread::hardware_concurrency(),
+					  num_rows / kMinRowsPerBand));
+  const int band = (num_rows + num_threads - 1) / num_threads;
+  auto draw_band = [&](int row_begin, int row_end) {
+    for (const LineSegment &s : segments)
+      DrawLineInRows(s.x0, s.y0, s.x1, s.y1, s.color, s.rounding, row_begin,
+		     row_end, an_image);
+  };
+
+  vector<thread> pool;
+  for (int t = 1; t < num_threads; ++t)
+    pool.emplace_back(draw_band, t * band, min(num_rows, (t + 1) * band));
+  draw_band(0, min(num_rows, band));
+  for (thread &t : pool)
+    t.join();
+}
+
 }  // namespace ComputerVisionProjects
 
 
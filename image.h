@@ -1,12 +1,14 @@
 // Class for representing a 2D gray-scale image,
-// with support for reading/writing pgm images.
+// with support for reading/writing pgm (and color ppm) images.
 // To be used in Computer Vision class.
 
 #ifndef COMPUTER_VISION_IMAGE_H_
 #define COMPUTER_VISION_IMAGE_H_
 
+#include <algorithm>
 #include <cstdlib>
 #include <string>
+#include <vector>
 
 namespace ComputerVisionProjects {
  
@@ -33,6 +35,8 @@ class Image {
 
   // Sets the size of the image to the given
   // height (num_rows) and columns (num_columns).
+  // Pixels live in one row-major buffer from BufferPool::Global(), so
+  // images of a size seen before reuse a released buffer.
   void AllocateSpaceAndSetSize(size_t num_rows, size_t num_columns);
 
   size_t num_rows() const { return num_rows_; }
@@ -46,12 +50,23 @@ class Image {
   // to a particular gray_level.
   void SetPixel(size_t i, size_t j, int gray_level) {
     if (i >= num_rows_ || j >= num_columns_) abort();
-    pixels_[i][j] = gray_level;
+    pixels_[i * num_columns_ + j] = gray_level;
   }
 
   int GetPixel(size_t i, size_t j) const {
     if (i >= num_rows_ || j >= num_columns_) abort();
-    return pixels_[i][j];
+    return pixels_[i * num_columns_ + j];
+  }
+
+  // Returns the num_columns() contiguous pixels of row i, for
+  // kernels that sweep a whole row at a time.
+  const int *GetRow(size_t i) const {
+    if (i >= num_rows_) abort();
+    return pixels_ + i * num_columns_;
+  }
+  int *GetRow(size_t i) {
+    if (i >= num_rows_) abort();
+    return pixels_ + i * num_columns_;
   }
 
  private:
@@ -60,25 +75,293 @@ class Image {
   size_t num_rows_; 
   size_t num_columns_; 
   size_t num_gray_levels_;  
-  int **pixels_;
+  int *pixels_;  // num_rows_ x num_columns_, row by row.
+};
+
+// Summed-area table (integral image) of an Image, optionally with a
+// second table of squared pixels, for O(1) sums, means and variances
+// over any rectangle once built.
+// Sample usage:
+//   IntegralImage sums;
+//   sums.Build(an_image);
+//   // Mean of rows 10..19, columns 30..49.
+//   const double mean = sums.Mean(10, 30, 20, 50);
+class IntegralImage {
+ public:
+  IntegralImage(): num_rows_{0}, num_columns_{0} { }
+
+  // Builds the table(s) for an_image in one linear pass (rows and then
+  // columns are split across threads).
+  void Build(const Image &an_image, bool with_squares = false);
+
+  size_t num_rows() const { return num_rows_; }
+  size_t num_columns() const { return num_columns_; }
+
+  // Sum of the pixels in rows [row0, row1) and columns [col0, col1).
+  long long Sum(size_t row0, size_t col0, size_t row1, size_t col1) const {
+    return BoxSum(sums_, row0, col0, row1, col1);
+  }
+
+  // Sum of the squared pixels; needs Build(..., true).
+  long long SquaredSum(size_t row0, size_t col0,
+		       size_t row1, size_t col1) const {
+    if (squares_.empty()) abort();
+    return BoxSum(squares_, row0, col0, row1, col1);
+  }
+
+  double Mean(size_t row0, size_t col0, size_t row1, size_t col1) const {
+    return double(Sum(row0, col0, row1, col1)) /
+      ((row1 - row0) * (col1 - col0));
+  }
+
+  // Variance of the pixels in the box; needs Build(..., true).
+  double Variance(size_t row0, size_t col0, size_t row1, size_t col1) const {
+    const double mean = Mean(row0, col0, row1, col1);
+    return double(SquaredSum(row0, col0, row1, col1)) /
+      ((row1 - row0) * (col1 - col0)) - mean * mean;
+  }
+
+ private:
+  long long BoxSum(const std::vector<long long> &table, size_t row0,
+		   size_t col0, size_t row1, size_t col1) const {
+    if (row0 > row1 || col0 > col1 || row1 > num_rows_ ||
+	col1 > num_columns_) abort();
+    const size_t stride = num_columns_ + 1;
+    return table[row1 * stride + col1] - table[row0 * stride + col1] -
+      table[row1 * stride + col0] + table[row0 * stride + col0];
+  }
+
+  size_t num_rows_;
+  size_t num_columns_;
+  // (num_rows + 1) x (num_columns + 1), first row and column all 0.
+  std::vector<long long> sums_;
+  std::vector<long long> squares_;
+};
+
+// Same pixels as an Image, but stored in kTileSize x kTileSize tiles
+// (each tile row-major, tiles row-major), so that a neighborhood spanning
+// several rows sits in a few KiB instead of several rows of a wide image.
+// Edge tiles are padded to the full tile size. Pixels can be visited
+// without knowing about the tiling through begin()/end(), in memory
+// order, or one whole tile at a time through GetTile().
+// Sample usage:
+//   TiledImage tiled;
+//   ConvertToTiled(an_image, &tiled);
+//   for (TiledImage::Iterator p = tiled.begin(); p != tiled.end(); ++p)
+//     if (p.row() == p.column()) *p = 0;
+//   ConvertToRowMajor(tiled, &an_image);
+class TiledImage {
+ public:
+  static const size_t kTileSize = 64;
+
+  // Visits every pixel (never the padding) tile by tile.
+  class Iterator {
+   public:
+    size_t row() const { return tile_row_ * kTileSize + row_; }
+    size_t column() const { return tile_column_ * kTileSize + column_; }
+    int &operator*() const { return tile_[row_ * kTileSize + column_]; }
+
+    Iterator &operator++() {
+      if (++column_ < width_) return *this;
+      column_ = 0;
+      if (++row_ < height_) return *this;
+      row_ = 0;
+      if (++tile_column_ == image_->num_tile_columns()) {
+	tile_column_ = 0;
+	++tile_row_;
+      }
+      SetTile();
+      return *this;
+    }
+
+    bool operator==(const Iterator &other) const {
+      return tile_row_ == other.tile_row_ &&
+	tile_column_ == other.tile_column_ && row_ == other.row_ &&
+	column_ == other.column_;
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+   private:
+    friend class TiledImage;
+    Iterator(TiledImage *image, size_t tile_row):
+      image_{image}, tile_row_{tile_row}, tile_column_{0}, row_{0},
+      column_{0} { SetTile(); }
+
+    void SetTile() {
+      if (tile_row_ >= image_->num_tile_rows()) return;
+      tile_ = image_->GetTile(tile_row_, tile_column_);
+      height_ = image_->TileHeight(tile_row_);
+      width_ = image_->TileWidth(tile_column_);
+    }
+
+    TiledImage *image_;
+    size_t tile_row_, tile_column_;
+    size_t row_, column_;  // Within the tile.
+    size_t height_ = 0, width_ = 0;
+    int *tile_ = nullptr;
+  };
+
+  TiledImage(): num_rows_{0}, num_columns_{0}, num_tile_rows_{0},
+		num_tile_columns_{0}, num_gray_levels_{0},
+		pixels_{nullptr} { }
+
+  TiledImage(const TiledImage &an_image) = delete;
+  TiledImage& operator=(const TiledImage &an_image) = delete;
+
+  ~TiledImage();
+
+  // Sets the size of the image (contents undefined, padding included).
+  // The buffer comes from BufferPool::Global(), like Image's.
+  void AllocateSpaceAndSetSize(size_t num_rows, size_t num_columns);
+
+  size_t num_rows() const { return num_rows_; }
+  size_t num_columns() const { return num_columns_; }
+  size_t num_tile_rows() const { return num_tile_rows_; }
+  size_t num_tile_columns() const { return num_tile_columns_; }
+  size_t num_gray_levels() const { return num_gray_levels_; }
+  void SetNumberGrayLevels(size_t gray_levels) {
+    num_gray_levels_ = gray_levels;
+  }
+
+  void SetPixel(size_t i, size_t j, int gray_level) {
+    if (i >= num_rows_ || j >= num_columns_) abort();
+    pixels_[Offset(i, j)] = gray_level;
+  }
+
+  int GetPixel(size_t i, size_t j) const {
+    if (i >= num_rows_ || j >= num_columns_) abort();
+    return pixels_[Offset(i, j)];
+  }
+
+  // The kTileSize x kTileSize pixels of a tile, row by row. Only the
+  // first TileHeight() rows and TileWidth() columns are in the image.
+  const int *GetTile(size_t tile_row, size_t tile_column) const {
+    if (tile_row >= num_tile_rows_ || tile_column >= num_tile_columns_)
+      abort();
+    return pixels_ + (tile_row * num_tile_columns_ + tile_column) *
+      kTileSize * kTileSize;
+  }
+  int *GetTile(size_t tile_row, size_t tile_column) {
+    return const_cast<int *>(
+      static_cast<const TiledImage *>(this)->GetTile(tile_row, tile_column));
+  }
+
+  size_t TileHeight(size_t tile_row) const {
+    return std::min(kTileSize, num_rows_ - tile_row * kTileSize);
+  }
+  size_t TileWidth(size_t tile_column) const {
+    return std::min(kTileSize, num_columns_ - tile_column * kTileSize);
+  }
+
+  Iterator begin() { return Iterator(this, 0); }
+  Iterator end() { return Iterator(this, num_tile_rows_); }
+
+ private:
+  void DeallocateSpace();
+
+  size_t Offset(size_t i, size_t j) const {
+    return ((i / kTileSize) * num_tile_columns_ + j / kTileSize) *
+      kTileSize * kTileSize + (i % kTileSize) * kTileSize + j % kTileSize;
+  }
+
+  size_t num_rows_;
+  size_t num_columns_;
+  size_t num_tile_rows_;
+  size_t num_tile_columns_;
+  size_t num_gray_levels_;
+  int *pixels_;
 };
 
+// Copies an_image into tiled (resized to match), a tile row at a time.
+void ConvertToTiled(const Image &an_image, TiledImage *tiled);
+
+// Copies tiled back into a row-major an_image (resized to match).
+void ConvertToRowMajor(const TiledImage &tiled, Image *an_image);
+
 // Reads a pgm image from file input_filename.
 // an_image is the resulting image.
+// Binary (P5) and ASCII (P2) files are accepted, with 8 or 16 bits per
+// pixel (gray levels > 255). A ppm (P6/P3) color file is also accepted
+// and converted to gray.
 // Returns true if  everyhing is OK, false otherwise.
 bool ReadImage(const std::string &input_filename, Image *an_image);
 
-// Writes image an_iamge into the pgm file output_filename.
+// Reads a ppm (P6) image from file input_filename into three planes,
+// red, green and blue. A pgm file gives three identical planes.
+// Returns true if  everyhing is OK, false otherwise.
+bool ReadColorImage(const std::string &input_filename, Image *red,
+		    Image *green, Image *blue);
+
+// Luminance (ITU-R BT.601 weights) of three color planes, into gray.
+void ConvertToGray(const Image &red, const Image &green, const Image &blue,
+		   Image *gray);
+
+// Reads all of input_filenames at the same time on a small pool of
+// I/O threads, after asking the OS to start reading ahead on every file.
+// images is resized to hold one image per filename, in the same order.
+// Returns true if everything is OK; otherwise false, and *failed_index
+// (when given) is set to the position of a file that could not be read.
+bool ReadImages(const std::vector<std::string> &input_filenames,
+		std::vector<Image> *images, size_t *failed_index = nullptr);
+
+// Same as ReadImages(), using ReadColorImage(): planes gets three images
+// (red, green, blue) per filename.
+bool ReadColorImages(const std::vector<std::string> &input_filenames,
+		     std::vector<Image> *planes, size_t *failed_index = nullptr);
+
+// Writes image an_iamge into the pgm file output_filename
+// (16 bits per pixel if it has more than 255 gray levels).
 // Returns true if  everyhing is OK, false otherwise.
 bool WriteImage(const std::string &output_filename, const Image &an_image);
 
+// Writes the red, green and blue planes into the ppm (P6) file
+// output_filename. Returns true if  everyhing is OK, false otherwise.
+bool WriteColorImage(const std::string &output_filename, const Image &red,
+		     const Image &green, const Image &blue);
+
+// Halves an_image in both directions with a 2x2 box filter (rounded
+// average) into half. An odd last row or column is dropped.
+void Downsample2x(const Image &an_image, Image *half);
+
+// Same for a tiled image: every input tile becomes one quarter of an
+// output tile, so both sides are read and written tile by tile.
+void Downsample2x(const TiledImage &an_image, TiledImage *half);
+
+// Builds num_levels pyramid levels below an_image: (*pyramid)[k] is
+// an_image downsampled k + 1 times with Downsample2x().
+void BuildPyramid(const Image &an_image, int num_levels,
+		  std::vector<Image> *pyramid);
+
 //  Draws a line of given gray-level color from (x0,y0) to (x1,y1);
-//  an_image is the input/output image. 
-// IMPORTANT: (x0,y0) and (x1,y1) can lie outside the image 
-//   boundaries, so SetPixel() should check the coordinates passed to it.
+//  an_image is the input/output image. x is the row, y the column.
+//  (x0,y0) and (x1,y1) can lie outside the image boundaries; the line
+//  is clipped to the image before drawing.
 void DrawLine(int x0, int y0, int x1, int y1, int color,
 	      Image *an_image);
 
+// How a line picks its pixel across the major axis.
+enum class LineRounding {
+  // Bresenham's line, halves to the smaller coordinate, like DrawLine().
+  kMidpoint,
+  // (x1 - x0) / steps and (y1 - y0) / steps added up in float, each
+  // coordinate std::round()-ed: the DDA s3 has always drawn needles with.
+  // Mostly the same pixels; halves go away from zero or wherever float
+  // error pushes them.
+  kFloatSteps,
+};
+
+// One line for DrawLines(), same conventions as DrawLine().
+struct LineSegment {
+  int x0, y0, x1, y1;
+  int color;
+  LineRounding rounding = LineRounding::kMidpoint;
+};
+
+// Draws all segments, in order (later ones over earlier ones), into
+// an_image. Row bands are drawn in parallel; the result is the same as
+// calling DrawLine() on each segment.
+void DrawLines(const std::vector<LineSegment> &segments, Image *an_image);
+
 }  // namespace ComputerVisionProjects
 
 #endif  // COMPUTER_VISION_IMAGE_H_
@@ -0,0 +1,270 @@
+/**
+ * Times the neighborhood-heavy image operations in both memory layouts
+ * (row-major Image and 64x64-tiled TiledImage) so each stage can pick the faster one
+ *
+ * Operations:
+ *  convert     row-major -> tiled and back
+ *  downsample  one pyramid level (2x2 box filter)
+ *  box 3x3     local filter, like smoothing a normal map (edges clamped)
+ *  columns     running sum down every column, in strips of kTileSize columns
+ *              (the access pattern of integrating normals along x)
+ *
+ * Both layouts must give the same pixels, which is checked before printing the times
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include "image.h"
+
+using namespace std;
+using namespace ComputerVisionProjects;
+
+const size_t kTileSize = TiledImage::kTileSize;
+
+/**
+ * Best of repeats runs of op, in milliseconds
+ */
+double timeOperation(int repeats, const function<void()>& op){
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++){
+        const auto start = chrono::steady_clock::now();
+        op();
+        const auto stop = chrono::steady_clock::now();
+        best = min(best, chrono::duration<double, milli>(stop - start).count());
+    }
+    return best;
+}
+
+/**
+ * Deterministic test pattern, something like an 8-bit photo (smooth gradient plus noise)
+ */
+void makeTestImage(size_t num_rows, size_t num_columns, Image* an_image){
+    an_image->AllocateSpaceAndSetSize(num_rows, num_columns);
+    an_image->SetNumberGrayLevels(255);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < num_rows; ++i){
+        int* row = an_image->GetRow(i);
+        for (size_t j = 0; j < num_columns; ++j){
+            state = state * 1664525u + 1013904223u;
+            row[j] = ((i + j) / 8 + (state >> 28)) % 256;
+        }
+    }
+}
+
+/**
+ * Sum of the 3x3 neighborhood of every pixel, with rows/columns outside the image clamped to the edge
+ */
+void boxFilter(const Image& in, Image* out){
+    const size_t num_rows = in.num_rows();
+    const size_t num_columns = in.num_columns();
+    out->AllocateSpaceAndSetSize(num_rows, num_columns);
+    out->SetNumberGrayLevels(in.num_gray_levels());
+
+    for (size_t i = 0; i < num_rows; ++i){
+        const int* above = in.GetRow(i > 0 ? i - 1 : 0);
+        const int* row = in.GetRow(i);
+        const int* below = in.GetRow(min(i + 1, num_rows - 1));
+        int* result = out->GetRow(i);
+        // only the first and last columns need clamping
+        auto filter = [&](size_t j){
+            const size_t left = j > 0 ? j - 1 : 0;
+            const size_t right = min(j + 1, num_columns - 1);
+            result[j] = above[left] + above[j] + above[right] + row[left] + row[j] + row[right]
+                + below[left] + below[j] + below[right];
+        };
+        filter(0);
+        for (size_t j = 1; j + 1 < num_columns; ++j){
+            result[j] = above[j - 1] + above[j] + above[j + 1] + row[j - 1] + row[j] + row[j + 1]
+                + below[j - 1] + below[j] + below[j + 1];
+        }
+        if (num_columns > 1){
+            filter(num_columns - 1);
+        }
+    }
+}
+
+/**
+ * Tiled version: every tile is copied with a one pixel border (taken from its neighbours, or clamped at
+ * the image edges) into a small buffer, and filtered from there
+ */
+void boxFilter(const TiledImage& in, TiledImage* out){
+    const size_t kHaloSize = kTileSize + 2;
+    out->AllocateSpaceAndSetSize(in.num_rows(), in.num_columns());
+    out->SetNumberGrayLevels(in.num_gray_levels());
+    vector<int> halo(kHaloSize * kHaloSize);
+
+    for (size_t ti = 0; ti < in.num_tile_rows(); ++ti){
+        const size_t height = in.TileHeight(ti);
+        for (size_t tj = 0; tj < in.num_tile_columns(); ++tj){
+            const size_t width = in.TileWidth(tj);
+            const int* tile = in.GetTile(ti, tj);
+
+            // interior straight from the tile, the border ring pixel by pixel
+            for (size_t r = 0; r < height; ++r){
+                memcpy(&halo[(r + 1) * kHaloSize + 1], tile + r * kTileSize, width * sizeof(int));
+            }
+            const long long row0 = ti * kTileSize;
+            const long long col0 = tj * kTileSize;
+            auto clamped = [&](long long i, long long j){
+                i = max(0LL, min(i, (long long)in.num_rows() - 1));
+                j = max(0LL, min(j, (long long)in.num_columns() - 1));
+                return in.GetPixel(i, j);
+            };
+            for (long long c = 0; c < (long long)width + 2; ++c){
+                halo[c] = clamped(row0 - 1, col0 + c - 1);
+                halo[(height + 1) * kHaloSize + c] = clamped(row0 + height, col0 + c - 1);
+            }
+            for (long long r = 1; r <= (long long)height; ++r){
+                halo[r * kHaloSize] = clamped(row0 + r - 1, col0 - 1);
+                halo[r * kHaloSize + width + 1] = clamped(row0 + r - 1, col0 + width);
+            }
+
+            int* result = out->GetTile(ti, tj);
+            for (size_t r = 0; r < height; ++r){
+                const int* above = &halo[r * kHaloSize + 1];
+                const int* row = above + kHaloSize;
+                const int* below = row + kHaloSize;
+                for (size_t c = 0; c < width; ++c){
+                    result[r * kTileSize + c] = above[c - 1] + above[c] + above[c + 1] + row[c - 1] + row[c]
+                        + row[c + 1] + below[c - 1] + below[c] + below[c + 1];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Running sum down every column, a strip of kTileSize columns at a time (top to bottom)
+ */
+void integrateColumns(const Image& in, Image* out){
+    out->AllocateSpaceAndSetSize(in.num_rows(), in.num_columns());
+    out->SetNumberGrayLevels(in.num_gray_levels());
+    int sums[kTileSize];
+    for (size_t j0 = 0; j0 < in.num_columns(); j0 += kTileSize){
+        const size_t width = min(kTileSize, in.num_columns() - j0);
+        fill_n(sums, width, 0);
+        for (size_t i = 0; i < in.num_rows(); ++i){
+            const int* row = in.GetRow(i) + j0;
+            int* result = out->GetRow(i) + j0;
+            for (size_t c = 0; c < width; ++c){
+                sums[c] += row[c];
+                result[c] = sums[c];
+            }
+        }
+    }
+}
+
+/**
+ * Tiled version: a strip is one tile column, so it is read tile after tile from contiguous memory
+ */
+void integrateColumns(const TiledImage& in, TiledImage* out){
+    out->AllocateSpaceAndSetSize(in.num_rows(), in.num_columns());
+    out->SetNumberGrayLevels(in.num_gray_levels());
+    int sums[kTileSize];
+    for (size_t tj = 0; tj < in.num_tile_columns(); ++tj){
+        const size_t width = in.TileWidth(tj);
+        fill_n(sums, width, 0);
+        for (size_t ti = 0; ti < in.num_tile_rows(); ++ti){
+            const int* tile = in.GetTile(ti, tj);
+            int* result = out->GetTile(ti, tj);
+            for (size_t r = 0; r < in.TileHeight(ti); ++r){
+                for (size_t c = 0; c < width; ++c){
+                    sums[c] += tile[r * kTileSize + c];
+                    result[r * kTileSize + c] = sums[c];
+                }
+            }
+        }
+    }
+}
+
+bool samePixels(const Image& row_major, const TiledImage& tiled){
+    Image converted;
+    ConvertToRowMajor(tiled, &converted);
+    if (row_major.num_rows() != converted.num_rows() || row_major.num_columns() != converted.num_columns()){
+        return false;
+    }
+    for (size_t i = 0; i < row_major.num_rows() && row_major.num_columns() > 0; ++i){
+        if (memcmp(row_major.GetRow(i), converted.GetRow(i), row_major.num_columns() * sizeof(int)) != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char **argv){
+    if (argc != 1 && argc != 2 && argc != 4){
+        printf("Usage: %s [{input image} | {rows} {columns} {repeats}]\n", argv[0]);
+        return 0;
+    }
+
+    // a real image, or a synthetic one (default 4096 x 4096)
+    Image input;
+    int repeats = 5;
+    if (argc == 2){
+        if (!ReadImage(argv[1], &input)){
+            cout << "Can't open file " << argv[1] << endl;
+            return 0;
+        }
+    }
+    else{
+        const size_t num_rows = argc == 4 ? stoul(argv[1]) : 4096;
+        const size_t num_columns = argc == 4 ? stoul(argv[2]) : 4096;
+        repeats = argc == 4 ? max(1, stoi(argv[3])) : repeats;
+        makeTestImage(num_rows, num_columns, &input);
+    }
+    TiledImage tiled_input;
+    ConvertToTiled(input, &tiled_input);
+
+    printf("%zu x %zu, %zux%zu tiles, best of %d runs (ms)\n", input.num_rows(), input.num_columns(),
+           kTileSize, kTileSize, repeats);
+    printf("%-12s %12s %12s\n", "operation", "row-major", "tiled");
+
+    Image round_trip;
+    TiledImage tiled;
+    const double to_tiled = timeOperation(repeats, [&](){ ConvertToTiled(input, &tiled); });
+    const double to_row_major = timeOperation(repeats, [&](){ ConvertToRowMajor(tiled, &round_trip); });
+    printf("%-12s %12.2f %12.2f   (to row-major / to tiled)\n", "convert", to_row_major, to_tiled);
+
+    Image row_major_out;
+    TiledImage tiled_out;
+    bool ok = samePixels(input, tiled);
+
+    const double downsample_rows = timeOperation(repeats, [&](){ Downsample2x(input, &row_major_out); });
+    const double downsample_tiles = timeOperation(repeats, [&](){ Downsample2x(tiled_input, &tiled_out); });
+    printf("%-12s %12.2f %12.2f\n", "downsample", downsample_rows, downsample_tiles);
+    ok &= samePixels(row_major_out, tiled_out);
+
+    const double box_rows = timeOperation(repeats, [&](){ boxFilter(input, &row_major_out); });
+    const double box_tiles = timeOperation(repeats, [&](){ boxFilter(tiled_input, &tiled_out); });
+    printf("%-12s %12.2f %12.2f\n", "box 3x3", box_rows, box_tiles);
+    ok &= samePixels(row_major_out, tiled_out);
+
+    const double columns_rows = timeOperation(repeats, [&](){ integrateColumns(input, &row_major_out); });
+    const double columns_tiles = timeOperation(repeats, [&](){ integrateColumns(tiled_input, &tiled_out); });
+    printf("%-12s %12.2f %12.2f\n", "columns", columns_rows, columns_tiles);
+    ok &= samePixels(row_major_out, tiled_out);
+
+    // iterators hide the tiling: same pixel sum either way
+    long long sum_rows = 0, sum_tiles = 0;
+    for (size_t i = 0; i < input.num_rows(); ++i){
+        for (size_t j = 0; j < input.num_columns(); ++j){
+            sum_rows += input.GetPixel(i, j);
+        }
+    }
+    for (TiledImage::Iterator p = tiled_input.begin(); p != tiled_input.end(); ++p){
+        sum_tiles += *p;
+    }
+    ok &= sum_rows == sum_tiles;
+
+    if (!ok){
+        cout << "Row-major and tiled results differ" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -11,7 +11,10 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <algorithm>
 #include "image.h"
+#include "calibration_cache.h"
 
 using namespace std;
 using namespace ComputerVisionProjects;
@@ -42,11 +45,41 @@ void writeOutputFile(const int xbar, const int ybar, const int radius, const str
 
 }
 
-void calculateGeometry(Image *binary_image, const string output_file){
-    if (binary_image == nullptr) abort();
+// side of the blocks used to find the object's bounding box
+const int kBlockSize = 16;
+
+/**
+ * Finds the bounding box [row0, row1) x [col0, col1) of the blocks that
+ * contain any object pixel, using block sums from a summed-area table.
+ * Returns false if the image has no object pixels.
+ */
+bool findObjectBoundingBox(const Image &binary_image, int& row0, int& col0,
+                           int& row1, int& col1){
+    IntegralImage integral;
+    integral.Build(binary_image);
+
+    const int rows = binary_image.num_rows();
+    const int cols = binary_image.num_columns();
+    row0 = rows;
+    col0 = cols;
+    row1 = 0;
+    col1 = 0;
+    for (int r = 0; r < rows; r += kBlockSize){
+        const int r_end = min(rows, r + kBlockSize);
+        for (int c = 0; c < cols; c += kBlockSize){
+            const int c_end = min(cols, c + kBlockSize);
+            if (integral.Sum(r, c, r_end, c_end) == 0){continue;} // background block
+            row0 = min(row0, r);
+            col0 = min(col0, c);
+            row1 = max(row1, r_end);
+            col1 = max(col1, c_end);
+        }
+    }
+    return row0 < row1;
+}
 
-    int rows = binary_image->num_rows();
-    int cols = binary_image->num_columns();
+void calculateGeometry(Image *binary_image, int& xbar, int& ybar, int& radius){
+    if (binary_image == nullptr) abort();
 
     int leftmost = 1000000;
     int rightmost = -1;
@@ -54,13 +87,18 @@ void calculateGeometry(Image *binary_image, const string output_file){
     int sum_y = 0;
     int area = 0;
 
-    // iterate through image
-    for (int x = 0; x < rows; ++x){
-        for (int y = 0; y < cols; ++y){
+    // only the blocks around the object need an exact scan
+    int row0, col0, row1, col1;
+    if (!findObjectBoundingBox(*binary_image, row0, col0, row1, col1)){
+        row0 = row1 = col0 = col1 = 0;
+    }
 
-            int cur = binary_image->GetPixel(x,y);
+    // iterate through the bounding box
+    for (int x = row0; x < row1; ++x){
+        const int *row = binary_image->GetRow(x);
+        for (int y = col0; y < col1; ++y){
 
-            if(cur == 0){continue;} // skip background
+            if(row[y] == 0){continue;} // skip background
 
             else{
                 // iterate area
@@ -80,23 +118,46 @@ void calculateGeometry(Image *binary_image, const string output_file){
         }
     }
     
-    int xbar = sum_x / area;
-    int ybar = sum_y / area;
-    int radius = (rightmost-leftmost - 1)/2;
-
-    writeOutputFile(xbar, ybar,radius, output_file);
-
+    xbar = sum_x / area;
+    ybar = sum_y / area;
+    radius = (rightmost-leftmost - 1)/2;
 }
 
 int main(int argc, char **argv){
-  
-  if (argc!=4) {
-    printf("Usage: %s {input gray–level sphere image} {input threhsold value} {output parameters file} \n", argv[0]);
+
+  // optional --cache {calibration cache file} anywhere in the arguments
+  vector<string> args;
+  string cache_file;
+  for (int i = 1; i < argc; ++i) {
+    const string arg(argv[i]);
+    if (arg == "--cache" && i + 1 < argc) {
+      cache_file = argv[++i];
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  if (args.size() != 3) {
+    printf("Usage: %s {input gray–level sphere image} {input threhsold value} {output parameters file} [--cache {calibration cache file}]\n", argv[0]);
     return 0;
   }
-  const string input_file(argv[1]);
-  const int T = stoi(argv[2]);
-  const string output_file(argv[3]);
+  const string input_file(args[0]);
+  const int T = stoi(args[1]);
+  const string output_file(args[2]);
+
+  // skip everything if this sphere image and threshold were already done
+  CalibrationCache cache;
+  uint64_t key = 0;
+  if (!cache_file.empty()) {
+    ReadCalibrationCache(cache_file, &cache);
+    if (HashFile(input_file, &key)) {
+      key = CombineHash(key, T);
+      if (cache.has_sphere && cache.sphere_key == key) {
+        writeOutputFile(cache.xbar, cache.ybar, cache.radius, output_file);
+        return 0;
+      }
+    }
+  }
 
 
   Image an_image; // declare image object (2D array)
@@ -107,7 +168,23 @@ int main(int argc, char **argv){
 
   Image binary = an_image;
   ConvertToBinaryImage(&binary, T);
-  calculateGeometry(&binary, output_file);
+  int xbar, ybar, radius;
+  calculateGeometry(&binary, xbar, ybar, radius);
+  writeOutputFile(xbar, ybar, radius, output_file);
+
+  if (!cache_file.empty()) {
+    cache.has_sphere = true;
+    cache.sphere_key = key;
+    cache.xbar = xbar;
+    cache.ybar = ybar;
+    cache.radius = radius;
+    // lights in the cache were fitted to the old sphere, s2 has to run again
+    cache.has_lights = false;
+    cache.lights_key = 0;
+    cache.lights.clear();
+    cache.inverse.clear();
+    WriteCalibrationCache(cache_file, cache);
+  }
   
 // Optional: Output the binary image used for calculating geometry
 //   if (!WriteImage("binary.pgm", binary)){
@@ -7,13 +7,13 @@
  * (assume orthonormal projection)
  * 
  * Steps:
- *  1. Read sphere params (centroid and radius) and read 3 sphere images
+ *  1. Read sphere params (centroid and radius) and read the sphere images (one per light, 3 or more)
  *  2. For each sphere image
  *      Find brightest pixel location
  *      Calculate surface normal at that point using sphere geometry
  *      Scale the normal vector by the brightness value 
  *      all to determine light source direction and intensity
- * 3. Write three lines to output, each containing x,y,z of light source vector
+ * 3. Write one line per image to output, each containing x,y,z of light source vector
  * 
  */
 
@@ -26,7 +26,10 @@
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <future>
 #include "image.h"
+#include "calibration_cache.h"
 
 using namespace std;
 using namespace ComputerVisionProjects;
@@ -75,6 +78,37 @@ void findBrightestPixel(const Image* image, int& max_x, int& max_y, int& max_int
 
 
 
+/**
+ * Finds the window_size x window_size window with the highest mean intensity
+ * (using a summed-area table, so every window costs four lookups)
+ * updates params with the window's center and its mean intensity
+ * less sensitive to a single saturated or noisy pixel than findBrightestPixel
+ */
+void findBrightestWindow(const Image* image, int window_size, int& max_x, int& max_y, int& max_intensity){
+    const int rows = image->num_rows();
+    const int cols = image->num_columns();
+    window_size = max(1, min(window_size, min(rows, cols)));
+
+    IntegralImage integral;
+    integral.Build(*image);
+
+    long long max_sum = -1;
+    for (int i = 0; i + window_size <= rows; ++i){
+        for (int j = 0; j + window_size <= cols; ++j){
+
+            long long sum = integral.Sum(i, j, i + window_size, j + window_size);
+
+            if (sum > max_sum){
+                max_sum = sum;
+                max_x = i + window_size / 2;
+                max_y = j + window_size / 2;
+            }
+        }
+    }
+    const long long area = (long long)window_size * window_size;
+    max_intensity = int((max_sum + area / 2) / area);
+}
+
 /**
  * Calculates normal at given point on sphere (we pass in coords of brightest pixel)
  * using the following formula :
@@ -135,36 +169,148 @@ void writeLightDirections(const vector<Vector3D>& directions, const string& file
 
 
 
-int main(int argc, char **argv){
+/**
+ * One run of s2: params file from s1, sphere images (one per light) and the output directions file
+ */
+struct Job{
+    string params_file;
+    vector<string> sphere_files;
+    string output_file;
+    string cache_file;  // --cache {file}: reuse/store the light vectors in a calibration cache
+    int window = 0;     // --window {size}: use the brightest window instead of the brightest pixel
+};
 
-    if (argc != 6) {
-        printf("Usage: %s {input parameters filename} {sphere image 1} {sphere image 2} {sphere image 3} {output directions filename}\n", argv[0]);
-        return 0;
+bool parseJob(const vector<string>& all_args, Job& job){
+    vector<string> args;
+    for (size_t i = 0; i < all_args.size(); i++){
+        if (all_args[i] == "--cache" && i + 1 < all_args.size()){
+            job.cache_file = all_args[++i];
+        }
+        else if (all_args[i] == "--window" && i + 1 < all_args.size()){
+            job.window = stoi(all_args[++i]);
+        }
+        else{
+            args.push_back(all_args[i]);
+        }
+    }
+
+    if (args.size() < 5){
+        return false;
+    }
+    job.params_file = args[0];
+    job.sphere_files.assign(args.begin() + 1, args.end() - 1);
+    job.output_file = args.back();
+    return true;
+}
+
+/**
+ * Batch file: one job per line, same arguments as the normal command line
+ */
+vector<vector<string>> readBatchFile(const string& filename){
+    vector<vector<string>> jobs;
+    ifstream ifs(filename);
+    string line;
+
+    while (getline(ifs, line)){
+        istringstream iss(line);
+        vector<string> args;
+        string arg;
+        while (iss >> arg){
+            args.push_back(arg);
+        }
+        if (!args.empty()){
+            jobs.push_back(args);
+        }
+    }
+    return jobs;
+}
+
+/**
+ * Cache key for a job: the sphere params file, every sphere image and the window size
+ * returns false if one of them can't be read
+ */
+bool calibrationKey(const Job& job, uint64_t& key){
+    if (!HashFile(job.params_file, &key)){
+        return false;
+    }
+    if (job.window > 0){
+        key = CombineHash(key, job.window); // the plain brightest pixel keeps its old key
+    }
+    for (const auto& sphere_file : job.sphere_files){
+        uint64_t hash;
+        if (!HashFile(sphere_file, &hash)){
+            return false;
+        }
+        key = CombineHash(key, hash);
+    }
+    return true;
+}
+
+/**
+ * If the job's inputs match what's in its calibration cache, writes the cached light vectors
+ * and returns true (no need to load the sphere images at all)
+ */
+bool writeCachedLightDirections(const Job& job){
+    CalibrationCache cache;
+    uint64_t key;
+    if (job.cache_file.empty() || !ReadCalibrationCache(job.cache_file, &cache) || !cache.has_lights ||
+        !calibrationKey(job, key) || cache.lights_key != key || cache.num_lights() != job.sphere_files.size()){
+        return false;
     }
-    
-    const string params_file(argv[1]);
-    const string sphere_files[] = {argv[2], argv[3], argv[4]};
-    const string output_file(argv[5]);
-    
-    SphereParam sphere_params = readParams(params_file); // centroid and radius of sphere (from s1)
-    
 
-    // Process each image of sphere (3 total)
     vector<Vector3D> light_directions;
+    for (int i = 0; i < cache.num_lights(); ++i){
+        light_directions.push_back(Vector3D{cache.lights[3 * i], cache.lights[3 * i + 1], cache.lights[3 * i + 2]});
+    }
+    writeLightDirections(light_directions, job.output_file);
+    return true;
+}
 
-    for (int i = 0; i < 3; ++i){
+/**
+ * Stores the light vectors and their pseudo-inverse in the job's calibration cache (keeping what s1 put there)
+ * so s3 only ever reads the cache
+ */
+void storeLightDirections(const Job& job, const vector<Vector3D>& light_directions){
+    CalibrationCache cache;
+    uint64_t key;
+    if (job.cache_file.empty() || !calibrationKey(job, key)){
+        return;
+    }
+    ReadCalibrationCache(job.cache_file, &cache);
+    cache.has_lights = true;
+    cache.lights_key = key;
+    cache.lights.clear();
+    for (const auto& dir : light_directions){
+        cache.lights.push_back(dir.x);
+        cache.lights.push_back(dir.y);
+        cache.lights.push_back(dir.z);
+    }
+    if (!ComputeLightInverse(cache.lights, &cache.inverse)){
+        cache.inverse.clear();  // degenerate lights, s3 reports it
+    }
+    WriteCalibrationCache(job.cache_file, cache);
+}
+
+/**
+ * Finds the light source vector for each (already loaded) sphere image and writes them out
+ */
+void computeLightDirections(const Job& job, const vector<Image>& sphere_images){
+    SphereParam sphere_params = readParams(job.params_file); // centroid and radius of sphere (from s1)
+    
 
-        Image sphere_image;
+    // Process each image of sphere (one per light)
+    vector<Vector3D> light_directions;
 
-        // always check if image is valid!
-        if (!ReadImage(sphere_files[i], &sphere_image)){
-            cout << "Can't open file " << sphere_files[i] << endl;
-            return 0;
-        }
+    for (const auto& sphere_image : sphere_images){
         
         // Find brightest pixel, (pass these following variables in by reference)
         int max_x, max_y, max_intensity;
-        findBrightestPixel(&sphere_image, max_x, max_y, max_intensity);
+        if (job.window > 0){
+            findBrightestWindow(&sphere_image, job.window, max_x, max_y, max_intensity);
+        }
+        else{
+            findBrightestPixel(&sphere_image, max_x, max_y, max_intensity);
+        }
         
         // calculate normal at brightest point using sphere params from s1 and location of brightest pixel
         Vector3D normal = calculateNormal(max_x, max_y, sphere_params);
@@ -178,7 +324,72 @@ int main(int argc, char **argv){
     }
     
     // Write results to file
-    writeLightDirections(light_directions, output_file);
+    writeLightDirections(light_directions, job.output_file);
+    storeLightDirections(job, light_directions);
+}
+
+
+
+int main(int argc, char **argv){
+
+    vector<vector<string>> job_args;
+    if (argc == 3 && string(argv[1]) == "--batch"){
+        job_args = readBatchFile(argv[2]);
+    }
+    else{
+        job_args.push_back(vector<string>(argv + 1, argv + argc));
+    }
+    vector<Job> all_jobs;
+    for (const auto& args : job_args){
+        Job job;
+        if (!parseJob(args, job)){
+            printf("Usage: %s {input parameters filename} {sphere image 1} {sphere image 2} {sphere image 3} [... {sphere image N}] {output directions filename} [--cache {calibration cache file}] [--window {size}]\n", argv[0]);
+            printf("       %s --batch {jobs file, one set of the above arguments per line}\n", argv[0]);
+            return 0;
+        }
+        all_jobs.push_back(job);
+    }
+
+    // jobs with a calibration cache hit are done already, only the rest need their images
+    vector<Job> jobs;
+    for (const auto& job : all_jobs){
+        if (!writeCachedLightDirections(job)){
+            jobs.push_back(job);
+        }
+    }
+    if (jobs.empty()){
+        return 0;
+    }
+
+    // all images of a job load in parallel, and the next job's images load while this one runs
+    vector<Image> sphere_images;
+    size_t failed = 0;
+    bool loaded = ReadImages(jobs[0].sphere_files, &sphere_images, &failed);
+
+    for (size_t i = 0; i < jobs.size(); ++i){
+        vector<Image> next_images;
+        size_t next_failed = 0;
+        future<bool> next_loaded;
+        if (i + 1 < jobs.size()){
+            next_loaded = async(launch::async, [&](){
+                return ReadImages(jobs[i + 1].sphere_files, &next_images, &next_failed);
+            });
+        }
+
+        // always check if image is valid!
+        if (!loaded){
+            cout << "Can't open file " << jobs[i].sphere_files[failed] << endl;
+        }
+        else{
+            computeLightDirections(jobs[i], sphere_images);
+        }
+
+        if (next_loaded.valid()){
+            loaded = next_loaded.get();
+            failed = next_failed;
+            sphere_images.swap(next_images);
+        }
+    }
     
     return 0;
-}
\ No newline at end of file
+}
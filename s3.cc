@@ -11,16 +11,16 @@
  * 
  * Steps:
  * 1. Input
- *      Read light source directions/intensities from s2 output
- *      read 3 obj images
+ *      Read light source directions/intensities from s2 output (or estimate them from the object images with --uncalibrated)
+ *      read one obj image per light (3 or more)
  *      get step and threshold params
  * 2. For each valid pixel (brightness > threshold in all images)
  *      Set up the linear system using light directions and intensities
- *      Solve for surface normal and albedo
+ *      Solve for surface normal and albedo (least squares when there are more than 3 lights)
  *      Scale and store results
  * 3. Outputs
  *      Normals image
- *      Scale and create Albedo image 
+ *      Scale and create Albedo image (ppm with one albedo per channel for color objects, --color)
  * 
  * Albedo image is basically like a "material map"
  * Albedo represents the surface's reflective propety
@@ -36,7 +36,19 @@
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <future>
+#include <functional>
+#include <thread>
 #include "image.h"
+#include "buffer_pool.h"
+#include "calibration_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace ComputerVisionProjects;
@@ -56,31 +68,112 @@ vector<Vector3D> readLightDirections(const string& filename){
     while (getline(ifs, line)) {
         istringstream iss(line);
         Vector3D dir;
-        iss >> dir.y >> dir.x >> dir.z;
-        directions.push_back(dir);
+        if (iss >> dir.y >> dir.x >> dir.z){
+            directions.push_back(dir);
+        }
     }
     
     return directions;
 }
 
 /**
- * Assume that a pixel (x, y) is visible from all 3 light sources if its brightness in all 3 images is greater than a certain threshold. 
- * Check if pixel is above threshold!
- * threshold supplied as input
+ * Assume that a pixel (x, y) is visible from all light sources if its brightness in all images is greater than a certain threshold. 
+ * The test is done once per frame set: every row's visible pixels are grouped into runs of columns,
+ * and everything after that (solving, needles, albedo) only walks the runs
  * */
-bool isPixelVisible(int x, int y, const vector<Image>& images, int threshold){
+struct VisibleRun{
+    int y_begin;
+    int y_end;
+    int offset;   // index of the run's first pixel in SurfaceResults
+};
 
-    for (const auto& an_image : images){
-        if (an_image.GetPixel(x, y) <= threshold){
-            return false;
+struct VisibilityMask{
+    int num_rows = 0;
+    int num_columns = 0;
+    vector<VisibleRun> runs;
+    vector<int> row_start;   // runs of row x are runs[row_start[x]] .. runs[row_start[x + 1] - 1]
+    int num_visible = 0;
+};
+
+void buildVisibilityMask(const vector<Image>& images, int threshold, VisibilityMask& mask){
+    const int n = images.size();
+    mask.num_rows = images[0].num_rows();
+    mask.num_columns = images[0].num_columns();
+    mask.runs.clear();
+    mask.row_start.assign(1, 0);
+    mask.num_visible = 0;
+
+    vector<const int*> rows(n);
+    auto visible = [&](int y){
+        for (int k = 0; k < n; k++){
+            if (rows[k][y] <= threshold){
+                return false;
+            }
         }
+        return true;
+    };
+
+    for (int x = 0; x < mask.num_rows; ++x){
+        for (int k = 0; k < n; k++){
+            rows[k] = images[k].GetRow(x);
+        }
+        int y = 0;
+        while (y < mask.num_columns){
+            while (y < mask.num_columns && !visible(y)){
+                y++;
+            }
+            const int y_begin = y;
+            while (y < mask.num_columns && visible(y)){
+                y++;
+            }
+            if (y > y_begin){
+                mask.runs.push_back(VisibleRun{y_begin, y, mask.num_visible});
+                mask.num_visible += y - y_begin;
+            }
+        }
+        mask.row_start.push_back(mask.runs.size());
     }
-    return true;
 }
 
+/**
+ * Normals and albedos of the visible pixels only, in mask order (run after run),
+ * one packed float array per component
+ */
+struct SurfaceResults{
+    vector<float> nx;
+    vector<float> ny;
+    vector<float> nz;
+    vector<float> albedo;
+
+    void resize(int num_visible){
+        nx.assign(num_visible, 0.0f);
+        ny.assign(num_visible, 0.0f);
+        nz.assign(num_visible, 0.0f);
+        albedo.assign(num_visible, 0.0f);
+    }
+};
+
 
 
 
+/**
+ * Builds the 3x3 light direction matrix S and inverts it (S^-1) with Invert3x3
+ * returns false if S is singular (light directions too similar)
+ */
+bool invertLightMatrix(const vector<Vector3D>& light_dirs, double S_inv[3][3]){
+
+    // Create light direction matrix S (3x3)
+    double S[3][3];
+    for (int i = 0; i < 3; i++) {
+        S[i][0] = light_dirs[i].x;
+        S[i][1] = light_dirs[i].y;
+        S[i][2] = light_dirs[i].z;
+    }
+
+    // S^-1 by cofactors, shared with the calibration cache
+    return Invert3x3(S, S_inv);
+}
+
 /**
  * 
  * Use given parametrs (light direction vector and intensities) to solve the linear system of equations
@@ -100,46 +193,11 @@ bool isPixelVisible(int x, int y, const vector<Image>& images, int threshold){
  */
 bool solveLinearSystem(const vector<Vector3D>& light_dirs, const vector<int>& intensities, Vector3D& normal, double& albedo){
 
-    // Create light direction matrix S (3x3)
-    double S[3][3];
-    for (int i = 0; i < 3; i++) {
-        S[i][0] = light_dirs[i].x;
-        S[i][1] = light_dirs[i].y;
-        S[i][2] = light_dirs[i].z;
-    }
-
-
-    // CALCULATE INVERSE OF S (S^-1) 
-
-    // first calculate the determinant of S
-        // review of det (if it's 0 or close to 0, we caan't solve these equations). "how different are our light directions?"
-    double det = S[0][0] * (S[1][1] * S[2][2] - S[1][2] * S[2][1])
-                - S[0][1] * (S[1][0] * S[2][2] - S[1][2] * S[2][0])
-                + S[0][2] * (S[1][0] * S[2][1] - S[1][1] * S[2][0]);
-                 
-
-    // Check if matrix is invertible (i.e., if det is not close to 0)
-    if (fabs(det) < 1e-6)
-    {
+    double S_inv[3][3];
+    if (!invertLightMatrix(light_dirs, S_inv)){
         return false;
     }
     
-    double invDet = 1.0 / det; // use this to multiply ()
-    double S_inv[3][3];
-    
-    // calc S_inverse (3x3) using determinant
-    S_inv[0][0] =  (S[1][1] * S[2][2] - S[1][2] * S[2][1]) * invDet;
-    S_inv[0][1] = -(S[0][1] * S[2][2] - S[0][2] * S[2][1]) * invDet;
-    S_inv[0][2] =  (S[0][1] * S[1][2] - S[0][2] * S[1][1]) * invDet;
-    
-    S_inv[1][0] = -(S[1][0] * S[2][2] - S[1][2] * S[2][0]) * invDet;
-    S_inv[1][1] =  (S[0][0] * S[2][2] - S[0][2] * S[2][0]) * invDet;
-    S_inv[1][2] = -(S[0][0] * S[1][2] - S[0][2] * S[1][0]) * invDet;
-    
-    S_inv[2][0] =  (S[1][0] * S[2][1] - S[1][1] * S[2][0]) * invDet;
-    S_inv[2][1] = -(S[0][0] *S[2][1] - S[0][1] * S[2][0]) * invDet;
-    S_inv[2][2] =  (S[0][0] * S[1][1] - S[0][1] * S[1][0]) * invDet;
-    
     // calculate Normal by multiplying S^-1 by intensities vector (I)
     // N = S^-1 * I
     normal.x = S_inv[0][0]*intensities[0] + S_inv[0][1]*intensities[1] + S_inv[0][2]*intensities[2];
@@ -161,94 +219,1146 @@ bool solveLinearSystem(const vector<Vector3D>& light_dirs, const vector<int>& in
 }
 
 
+/**
+ * Pseudo-inverse P of the N x 3 light matrix S, so that N = P * I for any number of lights
+ *  3 lights: P = S^-1 (same as solveLinearSystem)
+ *  more lights: least squares, P = (S^T S)^-1 S^T
+ * P is 3 x N, stored row by row (same as what s2 stores in a calibration cache)
+ */
+bool computeLightPseudoInverse(const vector<Vector3D>& light_dirs, vector<double>& P){
+    vector<double> lights;
+    for (const auto& s : light_dirs){
+        lights.push_back(s.x);
+        lights.push_back(s.y);
+        lights.push_back(s.z);
+    }
+    return ComputeLightInverse(lights, &P);
+}
 
-// Draw a line representing the normal projection
-void drawNormalLine(Image* an_image, int row, int col, const Vector3D& normal){
-    // Scale factor for line
-    const int scale = 10;
-    
-    // Project 3D normal onto image plane (dropping z component) and calculate endpoint
-    int start_row = row;
-    int start_col = col;
-    int end_row = row + static_cast<int>(normal.x * scale);
-    int end_col = col + static_cast<int>(normal.y * scale);
-    
+/**
+ * Solves the visible pixels of row x, columns [y_begin, y_end), for a fixed number of lights N
+ * results go to out from index offset on
+ * P and the intensities live in N-sized arrays so the compiler can fully unroll the products
+ * (gives the same code as the hand written 3x3 case, but for any light count we specialize on)
+ */
+template <int N>
+void solveRow(const vector<double>& P, const vector<Image>& images, int x, int y_begin, int y_end,
+              SurfaceResults& out, int offset){
+    double coef[3][N];
+    for (int r = 0; r < 3; r++){
+        for (int k = 0; k < N; k++){
+            coef[r][k] = P[r * N + k];
+        }
+    }
+    const int* rows[N];
+    for (int k = 0; k < N; k++){
+        rows[k] = images[k].GetRow(x);
+    }
 
+    for (int y = y_begin; y < y_end; ++y){
+        int I[N];
+        for (int k = 0; k < N; k++){
+            I[k] = rows[k][y];
+        }
 
-    // Calculate the difference between end points
-    float d_row = end_row - start_row;
-    float d_col = end_col - start_col;
-    
-    // steps we need == longest difference
-    float steps = std::max(std::abs(d_row), std::abs(d_col));
-    
-    // calc how much to increment row and col each step
-    float row_increment = d_row / steps;
-    float col_increment = d_col / steps;
-    
-    float curr_row = start_row;
-    float curr_col = start_col;
-    
-    // Draw each point along the line
-    for (int i = 0; i <= steps; i++){
-        // Round to nearest pixel and draw
-        int pixel_row = std::round(curr_row);
-        int pixel_col = std::round(curr_col);
-        
-        // Check if point within image bounds
-        if (pixel_row >= 0 && pixel_row < an_image->num_rows() && 
-            pixel_col >= 0 && pixel_col < an_image->num_columns()){
-            an_image->SetPixel(pixel_row, pixel_col, 255);  // White line
-        }
-        
-        // proceed to next point
-        curr_row += row_increment;
-        curr_col += col_increment;
-    }
-
-
-    // draw black dot at base
-    an_image->SetPixel(row,col,0);
-    
+        double n[3];
+        for (int r = 0; r < 3; r++){
+            n[r] = 0;
+            for (int k = 0; k < N; k++){
+                n[r] += coef[r][k] * I[k];
+            }
+        }
+
+        double albedo = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (albedo > 0){
+            n[0] /= albedo;
+            n[1] /= albedo;
+            n[2] /= albedo;
+        }
+        const int i = offset + y - y_begin;
+        out.nx[i] = n[0];
+        out.ny[i] = n[1];
+        out.nz[i] = n[2];
+        out.albedo[i] = albedo;
+    }
 }
 
+/**
+ * Fallback for light counts without a specialization, same math with runtime sized loops
+ */
+void solveRowGeneric(const vector<double>& P, const vector<Image>& images, int x, int y_begin, int y_end,
+                     SurfaceResults& out, int offset){
+    const int num_lights = images.size();
+    vector<const int*> rows(num_lights);
+    for (int k = 0; k < num_lights; k++){
+        rows[k] = images[k].GetRow(x);
+    }
 
+    for (int y = y_begin; y < y_end; ++y){
+        double n[3] = {0, 0, 0};
+        for (int r = 0; r < 3; r++){
+            for (int k = 0; k < num_lights; k++){
+                n[r] += P[r * num_lights + k] * rows[k][y];
+            }
+        }
 
+        double albedo = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (albedo > 0){
+            n[0] /= albedo;
+            n[1] /= albedo;
+            n[2] /= albedo;
+        }
+        const int i = offset + y - y_begin;
+        out.nx[i] = n[0];
+        out.ny[i] = n[1];
+        out.nz[i] = n[2];
+        out.albedo[i] = albedo;
+    }
+}
 
-int main(int argc, char **argv){
+typedef void (*RowSolver)(const vector<double>& P, const vector<Image>& images, int x, int y_begin, int y_end,
+                          SurfaceResults& out, int offset);
 
-    if (argc != 9) {
-        printf("Usage: %s {input directions} {object image 1} {object image 2} {object image 3} {step} {threshold} {output normals} {output albedo}\n", argv[0]);
-        return 0;
+/**
+ * Picks the row solver for a light count once per run
+ */
+RowSolver pickRowSolver(int num_lights){
+    static const struct { int num_lights; RowSolver solve; } kRowSolvers[] = {
+        {3, solveRow<3>}, {4, solveRow<4>}, {6, solveRow<6>}, {8, solveRow<8>}, {12, solveRow<12>},
+    };
+    for (const auto& entry : kRowSolvers){
+        if (entry.num_lights == num_lights){
+            return entry.solve;
+        }
+    }
+    return solveRowGeneric;
+}
+
+
+/**
+ * Fixed-point copy of S^-1 for the integer kernel
+ * every coefficient is stored as round(S_inv * 2^shift) in an int16,
+ * with shift picked so the largest coefficient still fits
+ * 
+ * inputs are 8-bit so each product fits an int16 x int16 -> int32 multiply-add,
+ * and the sum of 3 products (< 3 * 2^15 * 2^8) can't overflow an int32
+ */
+struct FixedInverse{
+    int16_t coef[3][3];
+    int shift;
+};
+
+bool buildFixedInverse(const vector<Vector3D>& light_dirs, FixedInverse& fixed){
+    double S_inv[3][3];
+    if (!invertLightMatrix(light_dirs, S_inv)){
+        return false;
+    }
+
+    double max_coef = 0;
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 3; c++){
+            max_coef = max(max_coef, fabs(S_inv[r][c]));
+        }
+    }
+
+    // coefficients this large don't fit an int16 even unscaled
+    if (lround(max_coef) > 32767){
+        return false;
+    }
+
+    // largest shift that keeps round(max_coef * 2^shift) <= 32767
+    fixed.shift = 0;
+    while (fixed.shift < 30 && max_coef * ldexp(1.0, fixed.shift + 1) < 32767.0){
+        fixed.shift++;
+    }
+
+    for (int r = 0; r < 3; r++){
+        for (int c = 0; c < 3; c++){
+            fixed.coef[r][c] = static_cast<int16_t>(lround(ldexp(S_inv[r][c], fixed.shift)));
+        }
+    }
+    return true;
+}
+
+/**
+ * Integer version of solveLinearSystem for one whole row of pixels
+ * rows[k] is the row from object image k (intensities must be 0..255)
+ * 
+ * N = S^-1 * I is done with int16 coefficients / int32 accumulators (8 pixels per step with SSE2),
+ * then |N| and N/|N| use the approximate reciprocal square root (+ one Newton step)
+ * writes the normal and albedo of every column (callers pass one visible run at a time)
+ */
+void solveRowFixed(const FixedInverse& fixed, const int* const rows[3], int num_columns,
+                   float* nx, float* ny, float* nz, float* albedos){
+    const float unscale = ldexpf(1.0f, -fixed.shift);
+    int y = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c01[3], c2[3];
+    for (int r = 0; r < 3; r++){
+        // (c0, c1) pairs line up with the (I0, I1) pairs from unpacking, c2 pairs with (I2, 0)
+        c01[r] = _mm_set1_epi32((uint16_t)fixed.coef[r][0] | ((uint32_t)(uint16_t)fixed.coef[r][1] << 16));
+        c2[r] = _mm_set1_epi32((uint16_t)fixed.coef[r][2]);
+    }
+    const __m128 scale = _mm_set1_ps(unscale);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+
+    for (; y + 8 <= num_columns; y += 8){
+        __m128i I[3];
+        for (int k = 0; k < 3; k++){
+            I[k] = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(rows[k] + y)),
+                                   _mm_loadu_si128((const __m128i*)(rows[k] + y + 4)));
+        }
+
+        // two halves of 4 pixels each
+        for (int h = 0; h < 2; h++){
+            __m128i I01 = h == 0 ? _mm_unpacklo_epi16(I[0], I[1]) : _mm_unpackhi_epi16(I[0], I[1]);
+            __m128i I2 = h == 0 ? _mm_unpacklo_epi16(I[2], zero) : _mm_unpackhi_epi16(I[2], zero);
+
+            __m128 n[3];
+            for (int r = 0; r < 3; r++){
+                __m128i acc = _mm_add_epi32(_mm_madd_epi16(I01, c01[r]), _mm_madd_epi16(I2, c2[r]));
+                n[r] = _mm_mul_ps(_mm_cvtepi32_ps(acc), scale);
+            }
+
+            __m128 ss = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], n[0]), _mm_mul_ps(n[1], n[1])), _mm_mul_ps(n[2], n[2]));
+            __m128 rs = _mm_rsqrt_ps(ss);
+            // one Newton-Raphson step: rs = rs * (1.5 - 0.5 * ss * rs^2)
+            rs = _mm_mul_ps(rs, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, ss), _mm_mul_ps(rs, rs))));
+            // rsqrt(0) is inf, keep those pixels at zero like the double path
+            rs = _mm_and_ps(rs, _mm_cmpgt_ps(ss, _mm_setzero_ps()));
+
+            const int col = y + h * 4;
+            _mm_storeu_ps(nx + col, _mm_mul_ps(n[0], rs));
+            _mm_storeu_ps(ny + col, _mm_mul_ps(n[1], rs));
+            _mm_storeu_ps(nz + col, _mm_mul_ps(n[2], rs));
+            _mm_storeu_ps(albedos + col, _mm_mul_ps(ss, rs));
+        }
+    }
+#endif
+
+    // leftover columns (or everything when there's no SSE2)
+    for (; y < num_columns; y++){
+        float n[3];
+        for (int r = 0; r < 3; r++){
+            int32_t acc = fixed.coef[r][0] * rows[0][y] + fixed.coef[r][1] * rows[1][y] + fixed.coef[r][2] * rows[2][y];
+            n[r] = acc * unscale;
+        }
+        float ss = n[0]*n[0] + n[1]*n[1] + n[2]*n[2];
+        float rs = ss > 0 ? 1.0f / sqrtf(ss) : 0.0f;
+        nx[y] = n[0] * rs;
+        ny[y] = n[1] * rs;
+        nz[y] = n[2] * rs;
+        albedos[y] = ss * rs;
+    }
+}
+
+
+
+// needle length (in pixels) of a normal lying in the image plane
+const int kNeedleScale = 10;
+
+/**
+ * Needle map: visiting only the grid points (every step pixels), one line per visible point along the
+ * projection of its normal onto the image plane (dropping z), then a black dot at its base
+ * segments come back in drawing order, for DrawLines (white is the output image's white)
+ */
+vector<LineSegment> buildNeedles(const VisibilityMask& mask, int step, const SurfaceResults& results, int white){
+    vector<LineSegment> needles;
+    for (int x = 0; x < mask.num_rows; x += step){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            // first grid column inside the run
+            for (int y = (run.y_begin + step - 1) / step * step; y < run.y_end; y += step){
+                const int i = run.offset + y - run.y_begin;
+                const int end_row = x + static_cast<int>(results.nx[i] * kNeedleScale);
+                const int end_col = y + static_cast<int>(results.ny[i] * kNeedleScale);
+                // same pixels as the needles have always had
+                needles.push_back(LineSegment{x, y, end_row, end_col, white, LineRounding::kFloatSteps});
+                needles.push_back(LineSegment{x, y, x, y, 0});
+            }
+        }
+    }
+    return needles;
+}
+
+/**
+ * Vector needle map (--svg {file}): the same needles as SVG lines, without rounding the end points,
+ * on a transparent canvas the size of the image so it can be laid over it
+ */
+bool writeNeedleSvg(const string& filename, const VisibilityMask& mask, int step, const SurfaceResults& results){
+    ofstream ofs(filename);
+    if (!ofs){
+        return false;
+    }
+    const int num_rows = mask.num_rows;
+    const int num_columns = mask.num_columns;
+    ofs << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << num_columns << "\" height=\"" << num_rows
+        << "\" viewBox=\"0 0 " << num_columns << " " << num_rows << "\">\n";
+    ofs << "<g stroke=\"white\" stroke-width=\"1\" stroke-linecap=\"round\">\n";
+
+    // svg x is the column and y the row, at pixel centers
+    for (int x = 0; x < num_rows; x += step){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            for (int y = (run.y_begin + step - 1) / step * step; y < run.y_end; y += step){
+                const int i = run.offset + y - run.y_begin;
+                ofs << "<line x1=\"" << y + 0.5 << "\" y1=\"" << x + 0.5
+                    << "\" x2=\"" << y + 0.5 + results.ny[i] * kNeedleScale << "\" y2=\"" << x + 0.5 + results.nx[i] * kNeedleScale << "\"/>\n";
+            }
+        }
+    }
+    ofs << "</g>\n</svg>\n";
+    return static_cast<bool>(ofs);
+}
+
+
+
+
+/**
+ * Compares the fixed-point results against the double path on every visible pixel
+ * and prints the worst normal angle error (degrees) and albedo error (relative)
+ */
+void reportFixedPointError(const vector<Vector3D>& light_dirs, const vector<Image>& images, const VisibilityMask& mask,
+                           const SurfaceResults& results){
+    double max_angle = 0;
+    double max_albedo_err = 0;
+    int count = 0;
+
+    for (int x = 0; x < mask.num_rows; ++x){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            for (int y = run.y_begin; y < run.y_end; ++y){
+                vector<int> intensities;
+                for (const auto& an_image : images) {
+                    intensities.push_back(an_image.GetPixel(x, y));
+                }
+                Vector3D normal;
+                double albedo;
+                if (!solveLinearSystem(light_dirs, intensities, normal, albedo) || albedo <= 0){
+                    continue;
+                }
+
+                const int i = run.offset + y - run.y_begin;
+                double dot = normal.x*results.nx[i] + normal.y*results.ny[i] + normal.z*results.nz[i];
+                double angle = acos(min(1.0, max(-1.0, dot))) * 180.0 / M_PI;
+                max_angle = max(max_angle, angle);
+                max_albedo_err = max(max_albedo_err, fabs(results.albedo[i] - albedo) / albedo);
+                count++;
+            }
+        }
+    }
+
+    printf("Fixed-point kernel error over %d pixels: max normal error %.4f deg, max albedo error %.4f%%\n",
+           count, max_angle, max_albedo_err * 100.0);
+}
+
+
+/**
+ * Uncalibrated photometric stereo (--uncalibrated): no sphere, the lights come from the object images themselves
+ * 
+ * Stacking the visible pixels as columns, the N x P intensity matrix M = L * B is rank 3
+ * (L = N x 3 lights, B = 3 x P albedo-scaled normals), so:
+ *  1. accumulate the N x N Gram matrix G = M * M^T = sum over pixels of m * m^T (never store M itself)
+ *  2. top 3 eigenvectors/values of G: M ~ (U3 * sqrt(E3)) * (E3^-1/2 * U3^T * M) = L^ * B^
+ *     any invertible A gives another answer: L = L^ * A^-1, B = A * B^
+ *  3. integrability (surface z(x,y) exists: d/dy(b1/b3) = d/dx(b2/b3)) pins A down to the
+ *     generalized bas-relief (GBR) ambiguity, which needs a prior (see integrabilityTransform)
+ */
+
+int numWorkerThreads(){
+    return max(1u, thread::hardware_concurrency());
+}
+
+/**
+ * Runs body(x_begin, x_end, t) on num_threads threads, thread t getting the t-th band of rows
+ * (callers keep one accumulator per t and add them up afterwards)
+ */
+void parallelRows(int num_rows, int num_threads, const function<void(int, int, int)>& body){
+    vector<thread> workers;
+    const int band = (num_rows + num_threads - 1) / num_threads;
+    for (int t = 0; t < num_threads; t++){
+        const int x_begin = min(num_rows, t * band);
+        const int x_end = min(num_rows, x_begin + band);
+        workers.emplace_back(body, x_begin, x_end, t);
+    }
+    for (auto& worker : workers){
+        worker.join();
+    }
+}
+
+/**
+ * Cyclic Jacobi eigen-decomposition of the symmetric n x n matrix A (row by row, destroyed)
+ * values come back largest first, and vectors[i * n + k] is component i of eigenvector k
+ */
+void symmetricEigen(vector<double> A, int n, vector<double>& values, vector<double>& vectors){
+    vector<double> V(n * n, 0.0);
+    for (int i = 0; i < n; i++){
+        V[i * n + i] = 1.0;
+    }
+
+    for (int sweep = 0; sweep < 100; sweep++){
+        double off = 0;
+        for (int i = 0; i < n; i++){
+            for (int j = i + 1; j < n; j++){
+                off += A[i * n + j] * A[i * n + j];
+            }
+        }
+        if (off < 1e-30){
+            break;
+        }
+
+        for (int p = 0; p < n; p++){
+            for (int q = p + 1; q < n; q++){
+                const double apq = A[p * n + q];
+                if (fabs(apq) < 1e-300){
+                    continue;
+                }
+                // rotation that zeroes A[p][q]
+                const double theta = (A[q * n + q] - A[p * n + p]) / (2 * apq);
+                const double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+                const double c = 1 / sqrt(t * t + 1);
+                const double sn = t * c;
+                for (int k = 0; k < n; k++){
+                    const double akp = A[k * n + p], akq = A[k * n + q];
+                    A[k * n + p] = c * akp - sn * akq;
+                    A[k * n + q] = sn * akp + c * akq;
+                }
+                for (int k = 0; k < n; k++){
+                    const double apk = A[p * n + k], aqk = A[q * n + k];
+                    A[p * n + k] = c * apk - sn * aqk;
+                    A[q * n + k] = sn * apk + c * aqk;
+                }
+                for (int k = 0; k < n; k++){
+                    const double vkp = V[k * n + p], vkq = V[k * n + q];
+                    V[k * n + p] = c * vkp - sn * vkq;
+                    V[k * n + q] = sn * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    // sort largest first
+    vector<int> order(n);
+    for (int k = 0; k < n; k++){
+        order[k] = k;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b){ return A[a * n + a] > A[b * n + b]; });
+    values.resize(n);
+    vectors.resize(n * n);
+    for (int k = 0; k < n; k++){
+        values[k] = A[order[k] * n + order[k]];
+        for (int i = 0; i < n; i++){
+            vectors[i * n + k] = V[i * n + order[k]];
+        }
+    }
+}
+
+Vector3D cross(const Vector3D& a, const Vector3D& b){
+    return Vector3D{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+double dot(const Vector3D& a, const Vector3D& b){
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+/**
+ * Takes the expected outer product of (noise x b) off the 3 x 3 block of a row-major 6 x 6 matrix starting at C,
+ * for noise with independent components of the given variances: [b]x * diag(variance) * [b]x^T
+ */
+void subtractCrossNoise(const Vector3D& b, const Vector3D& variance, double* C){
+    const double xx = b.z * b.z * variance.y + b.y * b.y * variance.z;
+    const double yy = b.z * b.z * variance.x + b.x * b.x * variance.z;
+    const double zz = b.y * b.y * variance.x + b.x * b.x * variance.y;
+    const double xy = -b.x * b.y * variance.z;
+    const double xz = -b.x * b.z * variance.y;
+    const double yz = -b.y * b.z * variance.x;
+    C[0 * 6 + 0] -= xx;  C[0 * 6 + 1] -= xy;  C[0 * 6 + 2] -= xz;
+    C[1 * 6 + 0] -= xy;  C[1 * 6 + 1] -= yy;  C[1 * 6 + 2] -= yz;
+    C[2 * 6 + 0] -= xz;  C[2 * 6 + 1] -= yz;  C[2 * 6 + 2] -= zz;
+}
+
+/**
+ * Step 1: G = sum of m * m^T over pixels visible in every image, one pass split across threads
+ */
+vector<double> accumulateGramMatrix(const vector<Image>& images, const VisibilityMask& mask){
+    const int n = images.size();
+    const int num_rows = images[0].num_rows();
+    const int num_threads = numWorkerThreads();
+    vector<vector<double>> partial(num_threads, vector<double>(n * n, 0.0));
+
+    parallelRows(num_rows, num_threads, [&](int x_begin, int x_end, int t){
+        vector<double>& G = partial[t];
+        vector<const int*> rows(n);
+        vector<double> m(n);
+        for (int x = x_begin; x < x_end; ++x){
+            for (int k = 0; k < n; k++){
+                rows[k] = images[k].GetRow(x);
+            }
+            for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+                for (int y = mask.runs[r].y_begin; y < mask.runs[r].y_end; ++y){
+                    for (int k = 0; k < n; k++){
+                        m[k] = rows[k][y];
+                    }
+                    for (int i = 0; i < n; i++){
+                        for (int j = i; j < n; j++){
+                            G[i * n + j] += m[i] * m[j];
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    vector<double> G(n * n, 0.0);
+    for (const auto& part : partial){
+        for (int i = 0; i < n * n; i++){
+            G[i] += part[i];
+        }
+    }
+    for (int i = 0; i < n; i++){
+        for (int j = 0; j < i; j++){
+            G[i * n + j] = G[j * n + i];
+        }
+    }
+    return G;
+}
+
+/**
+ * Step 3: finds A (rows a1, a2, a3) so that B = A * B^ is integrable
+ * 
+ * with b = A * b^, the integrability condition at a pixel becomes linear in u = a3 x a1 and v = a3 x a2:
+ *      u . (b^_left x b^_right) - v . (b^_up x b^_down) = 0
+ * (central differences, x is the row direction like everywhere in s3; pixels without all four neighbours
+ *  visible, i.e. the silhouette and shadow edges, are left out)
+ * the least squares (u, v) is the smallest eigenvector of the 6 x 6 sum of r * r^T, and then
+ *      a3 = u x v,  a1 = (u x a3) / |a3|^2,  a2 = (v x a3) / |a3|^2
+ * (plus any mu * a3 added to a1 / nu * a3 added to a2 / rescaling a3: that's the GBR part, which leaves
+ *  (u, v) alone up to scale, so the null space is one vector; mu = nu = 0 here and the scale of a3 is
+ *  picked so the median surface tilt is 45 degrees)
+ *
+ * image noise adds its own covariance to the sum of r * r^T, which pulls the smallest eigenvector away from
+ * the true (u, v) (a visible shear of the lights at 8 bits); with b^_variance the per-component noise
+ * variance of b^, the expected noise part of every row is known and subtracted
+ * (the two neighbours of a central difference have independent noise, a forward difference would share it)
+ * returns false if the images don't pin A down
+ */
+bool integrabilityTransform(const vector<Image>& images, const VisibilityMask& mask, const vector<double>& Q,
+                            const Vector3D& b_variance, Vector3D A[3]){
+    const int n = images.size();
+    const int num_rows = images[0].num_rows();
+    const int num_threads = numWorkerThreads();
+
+    // pseudo-normals b^ = Q * m of the visible pixels, in mask order (3 x P, never the N x P intensities)
+    vector<Vector3D> pseudo(mask.num_visible);
+    parallelRows(num_rows, num_threads, [&](int x_begin, int x_end, int /*t*/){
+        vector<const int*> rows(n);
+        for (int x = x_begin; x < x_end; ++x){
+            for (int k = 0; k < n; k++){
+                rows[k] = images[k].GetRow(x);
+            }
+            for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+                const VisibleRun& run = mask.runs[r];
+                for (int y = run.y_begin; y < run.y_end; ++y){
+                    Vector3D b{0, 0, 0};
+                    for (int k = 0; k < n; k++){
+                        const int I = rows[k][y];
+                        b.x += Q[0 * n + k] * I;
+                        b.y += Q[1 * n + k] * I;
+                        b.z += Q[2 * n + k] * I;
+                    }
+                    pseudo[run.offset + y - run.y_begin] = b;
+                }
+            }
+        }
+    });
+
+    // left / right neighbours are in the same run; up / down come from walking the runs of rows x - 1 and x + 1
+    // alongside, so only the spans visible in all three rows are visited
+    vector<vector<double>> partial(num_threads, vector<double>(36, 0.0));
+    parallelRows(num_rows, num_threads, [&](int x_begin, int x_end, int t){
+        vector<double>& C = partial[t];
+        for (int x = max(x_begin, 1); x < min(x_end, num_rows - 1); ++x){
+            int above = mask.row_start[x - 1];
+            int below = mask.row_start[x + 1];
+            for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+                const VisibleRun& run = mask.runs[r];
+                const int y_end = run.y_end - 1;
+                int y = run.y_begin + 1;
+                while (y < y_end){
+                    while (above < mask.row_start[x] && mask.runs[above].y_end <= y){
+                        above++;
+                    }
+                    while (below < mask.row_start[x + 2] && mask.runs[below].y_end <= y){
+                        below++;
+                    }
+                    if (above == mask.row_start[x] || below == mask.row_start[x + 2]){
+                        break;
+                    }
+                    const VisibleRun& up = mask.runs[above];
+                    const VisibleRun& down = mask.runs[below];
+                    const int span_begin = max(y, max(up.y_begin, down.y_begin));
+                    const int span_end = min(y_end, min(up.y_end, down.y_end));
+                    for (int ys = span_begin; ys < span_end; ++ys){
+                        const int p = run.offset + ys - run.y_begin;
+                        const Vector3D& b_up = pseudo[up.offset + ys - up.y_begin];
+                        const Vector3D& b_down = pseudo[down.offset + ys - down.y_begin];
+                        const Vector3D wy = cross(pseudo[p - 1], pseudo[p + 1]);
+                        const Vector3D wx = cross(b_up, b_down);
+                        const double row[6] = {wy.x, wy.y, wy.z, -wx.x, -wx.y, -wx.z};
+                        for (int i = 0; i < 6; i++){
+                            for (int j = 0; j < 6; j++){
+                                C[i * 6 + j] += row[i] * row[j];
+                            }
+                        }
+                        subtractCrossNoise(pseudo[p - 1], b_variance, &C[0]);
+                        subtractCrossNoise(pseudo[p + 1], b_variance, &C[0]);
+                        subtractCrossNoise(b_up, b_variance, &C[3 * 6 + 3]);
+                        subtractCrossNoise(b_down, b_variance, &C[3 * 6 + 3]);
+                    }
+                    y = max(span_begin, span_end);
+                }
+            }
+        }
+    });
+    vector<double> C(36, 0.0);
+    for (const auto& part : partial){
+        for (int i = 0; i < 36; i++){
+            C[i] += part[i];
+        }
+    }
+
+    vector<double> values, vectors;
+    symmetricEigen(C, 6, values, vectors);
+    const Vector3D u{vectors[0 * 6 + 5], vectors[1 * 6 + 5], vectors[2 * 6 + 5]};
+    const Vector3D v{vectors[3 * 6 + 5], vectors[4 * 6 + 5], vectors[5 * 6 + 5]};
+
+    const Vector3D a3 = cross(u, v);
+    const double len2 = dot(a3, a3);
+    if (len2 < 1e-12){
+        return false;
+    }
+    const Vector3D c1 = cross(u, a3);
+    const Vector3D c2 = cross(v, a3);
+    A[0] = Vector3D{c1.x / len2, c1.y / len2, c1.z / len2};
+    A[1] = Vector3D{c2.x / len2, c2.y / len2, c2.z / len2};
+    A[2] = a3;
+
+    // surfaces face the camera: flip A if most b3 come out negative
+    double sum_b3 = 0;
+    for (const auto& b : pseudo){
+        sum_b3 += dot(A[2], b) > 0 ? 1 : -1;
+    }
+    if (sum_b3 < 0){
+        for (int r = 0; r < 3; r++){
+            A[r] = Vector3D{-A[r].x, -A[r].y, -A[r].z};
+        }
+    }
+
+    // GBR depth scale: scale a3 so the median tilt is 45 degrees (what a sphere's projection has),
+    // i.e. median of |(b1, b2)| / |b3| is 1
+    vector<double> slopes;
+    slopes.reserve(pseudo.size());
+    for (const auto& b : pseudo){
+        const double b3 = fabs(dot(A[2], b));
+        if (b3 > 0){
+            slopes.push_back(hypot(dot(A[0], b), dot(A[1], b)) / b3);
+        }
+    }
+    if (!slopes.empty()){
+        nth_element(slopes.begin(), slopes.begin() + slopes.size() / 2, slopes.end());
+        const double scale = slopes[slopes.size() / 2];
+        A[2] = Vector3D{A[2].x * scale, A[2].y * scale, A[2].z * scale};
+    }
+    return true;
+}
+
+/**
+ * Estimates one light vector per image from the images alone (steps 1-3 above)
+ * with integrability == false, A stays the identity (raw factorization, only useful for debugging)
+ * returns false if the images don't have rank 3
+ */
+bool estimateLights(const vector<Image>& images, const VisibilityMask& mask, bool integrability, vector<Vector3D>& light_dirs){
+    const int n = images.size();
+
+    vector<double> values, U;
+    symmetricEigen(accumulateGramMatrix(images, mask), n, values, U);
+    if (values[2] <= 1e-9 * values[0]){
+        return false;
+    }
+
+    // L^ = U3 * sqrt(E3) (N x 3), Q = E3^-1/2 * U3^T (3 x N) so that b^ = Q * m
+    vector<Vector3D> lights_hat(n);
+    vector<double> Q(3 * n);
+    for (int k = 0; k < n; k++){
+        lights_hat[k] = Vector3D{U[k * n + 0] * sqrt(values[0]), U[k * n + 1] * sqrt(values[1]), U[k * n + 2] * sqrt(values[2])};
+        for (int r = 0; r < 3; r++){
+            Q[r * n + k] = U[k * n + r] / sqrt(values[r]);
+        }
+    }
+
+    // intensity noise variance: what's left outside rank 3 with more than 3 images (each extra eigenvalue
+    // is about num_visible * variance), never below the 1/12 of rounding to integer gray levels
+    double noise_variance = 1.0 / 12;
+    if (n > 3){
+        double rest = 0;
+        for (int k = 3; k < n; k++){
+            rest += values[k];
+        }
+        noise_variance = max(noise_variance, rest / ((n - 3) * double(mask.num_visible)));
+    }
+    // b^ = Q * m and Q * Q^T = E3^-1
+    const Vector3D b_variance{noise_variance / values[0], noise_variance / values[1], noise_variance / values[2]};
+
+    vector<Vector3D> A = {Vector3D{1, 0, 0}, Vector3D{0, 1, 0}, Vector3D{0, 0, 1}};
+    if (integrability && !integrabilityTransform(images, mask, Q, b_variance, A.data())){
+        cout << "Uncalibrated: integrability doesn't constrain the lights, keeping the raw factorization" << endl;
+        A = {Vector3D{1, 0, 0}, Vector3D{0, 1, 0}, Vector3D{0, 0, 1}};
+    }
+
+    // L = L^ * A^-1, i.e. light k is (A^-1)^T * l^_k
+    double A_inv[3][3];
+    if (!invertLightMatrix(A, A_inv)){
+        return false;
+    }
+    light_dirs.resize(n);
+    for (int k = 0; k < n; k++){
+        const Vector3D& l = lights_hat[k];
+        light_dirs[k] = Vector3D{l.x * A_inv[0][0] + l.y * A_inv[1][0] + l.z * A_inv[2][0],
+                                 l.x * A_inv[0][1] + l.y * A_inv[1][1] + l.z * A_inv[2][1],
+                                 l.x * A_inv[0][2] + l.y * A_inv[1][2] + l.z * A_inv[2][2]};
+    }
+    return true;
+}
+
+/**
+ * The directions argument can also be a calibration cache from s2 --cache, which holds the light vectors
+ * in full precision (directions.txt is rounded) and their pseudo-inverse
+ * the cache is only read (other jobs may be reading it at the same time)
+ * P comes back empty when there's no usable inverse; returns false for a cache without lights
+ */
+bool readLights(const string& filename, vector<Vector3D>& light_dirs, vector<double>& P){
+    CalibrationCache cache;
+    P.clear();
+    if (!ReadCalibrationCache(filename, &cache)){
+        light_dirs = readLightDirections(filename);
+        return true;
+    }
+    if (!cache.has_lights){
+        cout << "Calibration cache " << filename << " has no light directions (run s2 with --cache on it)" << endl;
+        return false;
+    }
+
+    light_dirs.clear();
+    for (int i = 0; i < cache.num_lights(); ++i){
+        light_dirs.push_back(Vector3D{cache.lights[3 * i], cache.lights[3 * i + 1], cache.lights[3 * i + 2]});
+    }
+    if (cache.inverse.size() == cache.lights.size()){
+        P = cache.inverse;
+    }
+    return true;
+}
+
+/**
+ * Streaming (--stream) keeps the previous frame set and its results around,
+ * and the image is split into kTileSize x kTileSize tiles that are re-solved only when their pixels change
+ */
+const int kTileSize = 32;
+
+struct StreamState{
+    vector<Image> frames;               // per tile, the frames its results were solved from, one per light
+    vector<Vector3D> light_dirs;
+    int threshold = 0;
+    bool fixed_point = false;
+    VisibilityMask mask;                // visible runs and results for the previous frame set
+    SurfaceResults results;
+};
+
+/**
+ * Previous results can be kept only if the lights, threshold, kernel and image sizes are all unchanged
+ */
+bool canReuseStreamState(const StreamState& state, const vector<Image>& images, const vector<Vector3D>& light_dirs,
+                         int threshold, bool fixed_point){
+    if (state.frames.size() != images.size() || state.threshold != threshold || state.fixed_point != fixed_point){
+        return false;
+    }
+    for (size_t k = 0; k < images.size(); k++){
+        if (state.frames[k].num_rows() != images[k].num_rows() || state.frames[k].num_columns() != images[k].num_columns()){
+            return false;
+        }
+        const Vector3D& a = state.light_dirs[k];
+        const Vector3D& b = light_dirs[k];
+        if (a.x != b.x || a.y != b.y || a.z != b.z){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Marks a tile dirty when the sum of absolute differences between the previous and current frames
+ * (over every light) is above tolerance
+ * dirty has one entry per tile, row by row
+ */
+void findDirtyTiles(const vector<Image>& previous, const vector<Image>& current, int tolerance, vector<bool>& dirty){
+    const int num_rows = current[0].num_rows();
+    const int num_columns = current[0].num_columns();
+    const int tile_columns = (num_columns + kTileSize - 1) / kTileSize;
+    vector<long long> sad(dirty.size(), 0);
+
+    for (size_t k = 0; k < current.size(); k++){
+        for (int x = 0; x < num_rows; ++x){
+            const int* before = previous[k].GetRow(x);
+            const int* after = current[k].GetRow(x);
+            long long* tile_sad = &sad[(x / kTileSize) * tile_columns];
+            for (int y = 0; y < num_columns; ++y){
+                tile_sad[y / kTileSize] += abs(after[y] - before[y]);
+            }
+        }
+    }
+
+    for (size_t t = 0; t < dirty.size(); t++){
+        dirty[t] = sad[t] > tolerance;
+    }
+}
+
+/**
+ * Copies the dirty tiles of the current frames into the reference frames; clean tiles keep the pixels their
+ * results were solved from, so changes below tolerance still add up until the tile is re-solved
+ */
+void updateReferenceFrames(const vector<Image>& current, const vector<bool>& dirty, vector<Image>& frames){
+    const int num_rows = current[0].num_rows();
+    const int num_columns = current[0].num_columns();
+    const int tile_columns = (num_columns + kTileSize - 1) / kTileSize;
+
+    for (size_t k = 0; k < current.size(); k++){
+        for (int x = 0; x < num_rows; ++x){
+            const int* after = current[k].GetRow(x);
+            int* reference = frames[k].GetRow(x);
+            for (int t = 0; t < tile_columns; t++){
+                if (dirty[(x / kTileSize) * tile_columns + t]){
+                    const int y_begin = t * kTileSize;
+                    copy(after + y_begin, after + min(num_columns, y_begin + kTileSize), reference + y_begin);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Fills columns [y_begin, y_end) of row x (inside a clean tile) from the previous frame set's results,
+ * results index offset on; pixels that weren't visible in the previous frame set have nothing to copy
+ * and go through solve_span(x, y_begin, y_end, offset) instead
+ */
+void copyPreviousResults(const StreamState& state, int x, int y_begin, int y_end, int offset, SurfaceResults& results,
+                         const function<void(int, int, int, int)>& solve_span){
+    const VisibilityMask& previous = state.mask;
+    int y = y_begin;
+    for (int r = previous.row_start[x]; r < previous.row_start[x + 1] && y < y_end; r++){
+        const VisibleRun& run = previous.runs[r];
+        if (run.y_end <= y){
+            continue;
+        }
+        if (run.y_begin >= y_end){
+            break;
+        }
+        if (run.y_begin > y){
+            solve_span(x, y, run.y_begin, offset + y - y_begin);
+            y = run.y_begin;
+        }
+        const int copy_end = min(y_end, run.y_end);
+        const int from = run.offset + y - run.y_begin;
+        const int to = offset + y - y_begin;
+        copy_n(&state.results.nx[from], copy_end - y, &results.nx[to]);
+        copy_n(&state.results.ny[from], copy_end - y, &results.ny[to]);
+        copy_n(&state.results.nz[from], copy_end - y, &results.nz[to]);
+        copy_n(&state.results.albedo[from], copy_end - y, &results.albedo[to]);
+        y = copy_end;
+    }
+    if (y < y_end){
+        solve_span(x, y, y_end, offset + y - y_begin);
+    }
+}
+
+/**
+ * One run of s3: the command line arguments, or one line of a batch file
+ */
+struct Job{
+    string directions_file;
+    vector<string> object_files;  // one per light
+    int step;
+    int threshold;
+    string normals_file;
+    string albedo_file;
+    bool fixed_point = false;   // --fixed: integer kernel instead of doubles
+    bool check_error = false;   // --check-error: measure the integer kernel against the double path
+    bool stream = false;        // --stream: batch lines are successive frame sets, only changed tiles get re-solved
+    int stream_tolerance = 0;   // --stream-tolerance {sad}: tiles whose sum of absolute differences is at most this count as unchanged
+    bool uncalibrated = false;  // --uncalibrated: no directions file, lights are estimated from the object images
+    bool integrability = true;  // --no-integrability: skip the integrability step of --uncalibrated
+    bool color = false;         // --color: color object images, albedo output is a ppm with one albedo per channel
+    int level = 0;              // --level {L}: preview, solve on images downsampled 2^L times
+    bool progressive = false;   // --progressive: solve coarse to fine (from --level, default 3), rewriting the outputs at each level
+    string svg_file;            // --svg {file}: also write the needle map as an SVG overlay
+};
+
+bool parseJob(const vector<string>& all_args, Job& job){
+
+    // optional flags can go anywhere, everything else is positional
+    vector<string> args;
+    for (size_t i = 0; i < all_args.size(); i++){
+        const string& arg = all_args[i];
+        if (arg == "--fixed"){
+            job.fixed_point = true;
+        }
+        else if (arg == "--check-error"){
+            job.fixed_point = true;
+            job.check_error = true;
+        }
+        else if (arg == "--uncalibrated"){
+            job.uncalibrated = true;
+        }
+        else if (arg == "--no-integrability"){
+            job.uncalibrated = true;
+            job.integrability = false;
+        }
+        else if (arg == "--level" && i + 1 < all_args.size()){
+            job.level = max(0, stoi(all_args[++i]));
+        }
+        else if (arg == "--svg" && i + 1 < all_args.size()){
+            job.svg_file = all_args[++i];
+        }
+        else if (arg == "--progressive"){
+            job.progressive = true;
+        }
+        else if (arg == "--color"){
+            job.color = true;
+        }
+        else if (arg == "--stream"){
+            job.stream = true;
+        }
+        else if (arg == "--stream-tolerance" && i + 1 < all_args.size()){
+            job.stream = true;
+            job.stream_tolerance = stoi(all_args[++i]);
+        }
+        else{
+            args.push_back(arg);
+        }
+    }
+
+    // uncalibrated runs have no directions file
+    const int first = job.uncalibrated ? 0 : 1;
+    if (args.size() < first + 7) {
+        return false;
     }
     
-    const string directions_file(argv[1]);
-    const string object_files[] = {argv[2], argv[3], argv[4]};
-    const int step = stoi(argv[5]);
-    const int threshold = stoi(argv[6]);
-    const string normals_file(argv[7]);
-    const string albedo_file(argv[8]);
-
-    // Read light directions from s2
-    vector<Vector3D> light_dirs = readLightDirections(directions_file);
-
-    // Read object images
-    vector<Image> images;
-
-    for (int i = 0; i < 3; i++){
-        Image an_image;
-        if (!ReadImage(object_files[i], &an_image)){
-            cout << "Can't open file " << object_files[i] << endl;
-            return 0;
+    // one object image per light, between the directions file and the step
+    const int num_lights = args.size() - first - 4;
+    if (!job.uncalibrated){
+        job.directions_file = args[0];
+    }
+    job.object_files.assign(args.begin() + first, args.begin() + first + num_lights);
+    job.step = stoi(args[first + num_lights]);
+    job.threshold = stoi(args[first + num_lights + 1]);
+    job.normals_file = args[first + num_lights + 2];
+    job.albedo_file = args[first + num_lights + 3];
+    return true;
+}
+
+/**
+ * Batch file: one job per line, same arguments as the normal command line
+ */
+vector<vector<string>> readBatchFile(const string& filename){
+    vector<vector<string>> jobs;
+    ifstream ifs(filename);
+    string line;
+
+    while (getline(ifs, line)){
+        istringstream iss(line);
+        vector<string> args;
+        string arg;
+        while (iss >> arg){
+            args.push_back(arg);
         }
+        if (!args.empty()){
+            jobs.push_back(args);
+        }
+    }
+    return jobs;
+}
 
-        images.push_back(an_image);
+/**
+ * Loads a job's object images; with --color also their red/green/blue planes (3 per light),
+ * and then images are the luminance of each color image (what the normals get solved from)
+ */
+bool loadFrames(const Job& job, vector<Image>* images, vector<Image>* color, size_t* failed){
+    if (!job.color){
+        color->clear();
+        return ReadImages(job.object_files, images, failed);
+    }
+    if (!ReadColorImages(job.object_files, color, failed)){
+        return false;
+    }
+    images->clear();
+    images->resize(job.object_files.size());
+    for (size_t k = 0; k < images->size(); k++){
+        ConvertToGray((*color)[3 * k], (*color)[3 * k + 1], (*color)[3 * k + 2], &(*images)[k]);
+    }
+    return true;
+}
+
+/**
+ * Per-channel albedo for --color, for every visible pixel
+ * the normal n comes from the gray solve and is shared by all channels, and each channel's albedo is
+ * its own N = P * I projected on n:  albedo_c = n . (P * I_c) = (P^T n) . I_c
+ * so w = P^T n is computed once per pixel and applied to R, G and B at once (one SIMD lane per channel)
+ * returns 4 floats per visible pixel (r, g, b, unused), in mask order
+ */
+vector<float> solveColorAlbedo(const vector<double>& P, const vector<Image>& color, const VisibilityMask& mask,
+                               const SurfaceResults& results){
+    const int n = color.size() / 3;
+    vector<float> albedos(size_t(mask.num_visible) * 4, 0.0f);
+    vector<float> w(n);
+    vector<const int*> planes(3 * n);
+
+    for (int x = 0; x < mask.num_rows; ++x){
+        for (int c = 0; c < 3 * n; c++){
+            planes[c] = color[c].GetRow(x);
+        }
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            for (int y = run.y_begin; y < run.y_end; ++y){
+                const int i = run.offset + y - run.y_begin;
+                for (int k = 0; k < n; k++){
+                    w[k] = results.nx[i] * P[0 * n + k] + results.ny[i] * P[1 * n + k] + results.nz[i] * P[2 * n + k];
+                }
+
+                float* out = &albedos[size_t(i) * 4];
+#ifdef __SSE2__
+                __m128 acc = _mm_setzero_ps();
+                for (int k = 0; k < n; k++){
+                    const __m128 rgb = _mm_cvtepi32_ps(_mm_setr_epi32(planes[3 * k][y], planes[3 * k + 1][y], planes[3 * k + 2][y], 0));
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), rgb));
+                }
+                _mm_storeu_ps(out, _mm_max_ps(acc, _mm_setzero_ps()));
+#else
+                for (int c = 0; c < 3; c++){
+                    float acc = 0;
+                    for (int k = 0; k < n; k++){
+                        acc += w[k] * planes[3 * k + c][y];
+                    }
+                    out[c] = max(acc, 0.0f);
+                }
+#endif
+            }
+        }
+    }
+    return albedos;
+}
+
+/**
+ * --color albedo output: per-channel albedos scaled together (by the largest of any channel) into a ppm
+ */
+void writeColorAlbedo(const Job& job, vector<double> P, const vector<Image>& color, const vector<Image>& images,
+                      const vector<Vector3D>& light_dirs, const VisibilityMask& mask, const SurfaceResults& results){
+    // the fixed-point kernel doesn't need P, so it may not exist yet
+    if (P.empty() && !computeLightPseudoInverse(light_dirs, P)){
+        return;
+    }
+    const vector<float> albedos = solveColorAlbedo(P, color, mask, results);
+    const float max_albedo = albedos.empty() ? 0.0f : *max_element(albedos.begin(), albedos.end());
+
+    // background stays black
+    Image channels[3] = {images[0], images[0], images[0]};
+    for (auto& channel : channels){
+        channel.SetNumberGrayLevels(255);
+        for (int x = 0; x < channel.num_rows(); ++x){
+            fill_n(channel.GetRow(x), channel.num_columns(), 0);
+        }
+    }
+    for (int x = 0; x < mask.num_rows; ++x){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            for (int y = run.y_begin; y < run.y_end; ++y){
+                const float* albedo = &albedos[size_t(run.offset + y - run.y_begin) * 4];
+                for (int c = 0; c < 3; c++){
+                    channels[c].SetPixel(x, y, max_albedo > 0 ? static_cast<int>(albedo[c] / max_albedo * 255) : 0);
+                }
+            }
+        }
+    }
+    if (!WriteColorImage(job.albedo_file, channels[0], channels[1], channels[2])){
+        cout << "Can't write to file " << job.albedo_file << endl;
+    }
+}
+
+/**
+ * Solves normals and albedo for one job whose object images are already loaded, and writes both outputs
+ * with stream != nullptr, tiles that didn't change since the previous frame set keep their old results
+ */
+void runJob(const Job& job, const vector<Image>& images, const vector<Image>& color, StreamState* stream){
+
+    const int num_lights = images.size();
+    bool fixed_point = job.fixed_point;
+    bool check_error = job.check_error;
+
+    // visible pixels are found once, every later pass walks their runs
+    VisibilityMask mask;
+    buildVisibilityMask(images, job.threshold, mask);
+
+    // Read light directions from s2 (or estimate them from the images)
+    vector<Vector3D> light_dirs;
+    vector<double> P;
+    if (job.uncalibrated){
+        if (!estimateLights(images, mask, job.integrability, light_dirs)){
+            cout << "Uncalibrated: object images don't have 3 independent lights" << endl;
+            return;
+        }
+        // same layout as a directions file from s2
+        printf("Uncalibrated: estimated light vectors (up to a bas-relief transform)\n");
+        for (const auto& dir : light_dirs){
+            printf("%g %g %g\n", dir.y, dir.x, dir.z);
+        }
+    }
+    else{
+        if (!readLights(job.directions_file, light_dirs, P)){
+            return;
+        }
+    }
+    if (light_dirs.size() != num_lights){
+        cout << "Expected " << num_lights << " light directions in " << job.directions_file << ", found " << light_dirs.size() << endl;
+        return;
+    }
+
+    // integer kernel assumes 3 lights with 8-bit intensities
+    if (fixed_point && num_lights != 3){
+        cout << "Fixed-point kernel needs exactly 3 lights, using doubles" << endl;
+        fixed_point = check_error = false;
+    }
+    if (fixed_point){
+        for (const auto& an_image : images){
+            if (an_image.num_gray_levels() > 255){
+                cout << "Fixed-point kernel needs 8-bit images, using doubles" << endl;
+                fixed_point = check_error = false;
+                break;
+            }
+        }
+    }
+    // singular lights, or coefficients too large for int16
+    FixedInverse fixed;
+    if (fixed_point && !buildFixedInverse(light_dirs, fixed)){
+        cout << "Fixed-point kernel can't hold the inverse of the light directions in " << job.directions_file
+             << ", using doubles" << endl;
+        fixed_point = check_error = false;
     }
 
     
     // Create output images
     Image normals_image = images[0]; 
     Image albedo_image = images[0];
+    albedo_image.SetNumberGrayLevels(255);  // 8-bit output even for 16-bit inputs
     
     // Initialize albedo image to black
     for (int i = 0; i < albedo_image.num_rows(); ++i){
@@ -256,66 +1366,275 @@ int main(int argc, char **argv){
             albedo_image.SetPixel(i, j, 0);
         }
     }
-    
-    // Find max albedo for scaling
-    double max_albedo = 0;
 
-    
-    // compute normals and find max albedo
-    vector<vector<Vector3D>> normals(images[0].num_rows(), vector<Vector3D>(images[0].num_columns()));
-    vector<vector<double>> albedos(images[0].num_rows(), vector<double>(images[0].num_columns()));
-
-    for (int x = 0; x < images[0].num_rows(); ++x){
-        for (int y = 0; y < images[0].num_columns(); ++y){
-            if (isPixelVisible(x, y, images, threshold)) {
-                // Get intensities for this pixel from all images
-                vector<int> intensities;
-                for (const auto& an_image : images) {
-                    intensities.push_back(an_image.GetPixel(x, y));
+    // without streaming the state only lives for this job
+    StreamState local_state;
+    StreamState& state = stream != nullptr ? *stream : local_state;
+    const int num_rows = images[0].num_rows();
+    const int num_columns = images[0].num_columns();
+    const int tile_rows = (num_rows + kTileSize - 1) / kTileSize;
+    const int tile_columns = (num_columns + kTileSize - 1) / kTileSize;
+
+    // previous results are only reusable if everything but the pixels is the same
+    vector<bool> dirty(tile_rows * tile_columns, true);
+    const bool reuse = canReuseStreamState(state, images, light_dirs, job.threshold, fixed_point);
+    if (reuse){
+        findDirtyTiles(state.frames, images, job.stream_tolerance, dirty);
+    }
+    SurfaceResults results;
+    results.resize(mask.num_visible);
+
+    // solves columns [y_begin, y_end) of row x (all visible) into results from offset on
+    function<void(int, int, int, int)> solve_span;
+    RowSolver solve_row = nullptr;
+    if (fixed_point){
+        solve_span = [&](int x, int y_begin, int y_end, int offset){
+            const int* const rows[3] = {images[0].GetRow(x) + y_begin, images[1].GetRow(x) + y_begin, images[2].GetRow(x) + y_begin};
+            solveRowFixed(fixed, rows, y_end - y_begin, &results.nx[offset], &results.ny[offset], &results.nz[offset],
+                          &results.albedo[offset]);
+        };
+    }
+    else{
+        if (P.empty() && !computeLightPseudoInverse(light_dirs, P)){
+            cout << "Light directions in " << job.directions_file << " are degenerate" << endl;
+            return;
+        }
+        solve_row = pickRowSolver(num_lights);
+        solve_span = [&](int x, int y_begin, int y_end, int offset){
+            solve_row(P, images, x, y_begin, y_end, results, offset);
+        };
+    }
+
+    // compute normals (only for dirty tiles, the rest comes from the previous frame set)
+    for (int x = 0; x < num_rows; ++x){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            if (!reuse){
+                solve_span(x, run.y_begin, run.y_end, run.offset);
+                continue;
+            }
+            // split the run at tile borders
+            for (int y = run.y_begin; y < run.y_end; ){
+                const int y_end = min(run.y_end, (y / kTileSize + 1) * kTileSize);
+                const int offset = run.offset + y - run.y_begin;
+                if (dirty[(x / kTileSize) * tile_columns + y / kTileSize]){
+                    solve_span(x, y, y_end, offset);
                 }
-                
-                Vector3D normal;
-                double albedo;
-                
-                if (solveLinearSystem(light_dirs, intensities, normal, albedo)) {
-                    normals[x][y] = normal;
-                    albedos[x][y] = albedo;
-                    max_albedo = max(max_albedo, albedo);
+                else{
+                    copyPreviousResults(state, x, y, y_end, offset, results, solve_span);
                 }
+                y = y_end;
             }
         }
     }
+    if (fixed_point && check_error){
+        reportFixedPointError(light_dirs, images, mask, results);
+    }
+
+    if (stream != nullptr){
+        const int num_dirty = count(dirty.begin(), dirty.end(), true);
+        printf("Stream: re-solved %d of %d tiles\n", num_dirty, (int)dirty.size());
+        if (reuse){
+            updateReferenceFrames(images, dirty, state.frames);
+        }
+        else{
+            vector<Image> frames(images);
+            state.frames.swap(frames);
+        }
+        state.light_dirs = light_dirs;
+        state.threshold = job.threshold;
+        state.fixed_point = fixed_point;
+        state.mask = mask;
+        state.results = results;
+    }
+
+    // Find max albedo for scaling
+    double max_albedo = 0;
+    for (const float albedo : results.albedo){
+        max_albedo = max(max_albedo, double(albedo));
+    }
     
     // create output images
-    for (int x = 0; x < images[0].num_rows(); ++x){
-        for (int y = 0; y < images[0].num_columns(); ++y){
+    DrawLines(buildNeedles(mask, job.step, results, normals_image.num_gray_levels()), &normals_image);
+    if (!job.svg_file.empty() && !writeNeedleSvg(job.svg_file, mask, job.step, results)){
+        cout << "Can't write to file " << job.svg_file << endl;
+    }
 
-            // Draw normal lines at grid points
-            if (x % step == 0 && y % step == 0 && isPixelVisible(x, y, images, threshold))
-            {
-                drawNormalLine(&normals_image, x, y, normals[x][y]);
-            }
-            
-            // Scale and set albedo
-            if (isPixelVisible(x, y, images, threshold))
-            {
+    for (int x = 0; x < num_rows; ++x){
+        for (int r = mask.row_start[x]; r < mask.row_start[x + 1]; r++){
+            const VisibleRun& run = mask.runs[r];
+            for (int y = run.y_begin; y < run.y_end; ++y){
+
+                // Scale and set albedo
                 // make int! 
-                int scaled_albedo = static_cast<int>((albedos[x][y] / max_albedo) * 255);
+                int scaled_albedo = static_cast<int>((results.albedo[run.offset + y - run.y_begin] / max_albedo) * 255);
                 albedo_image.SetPixel(x, y, scaled_albedo);
             }
         }
     }
     
     // output images
-    if (!WriteImage(normals_file, normals_image)){
-        cout << "Can't write to file " << normals_file << endl;
-        return 0;
+    if (!WriteImage(job.normals_file, normals_image)){
+        cout << "Can't write to file " << job.normals_file << endl;
+        return;
+    }
+    if (job.color){
+        writeColorAlbedo(job, P, color, images, light_dirs, mask, results);
+    }
+    else if (!WriteImage(job.albedo_file, albedo_image)){
+        cout << "Can't write to file " << job.albedo_file << endl;
+    }
+}
+
+
+/**
+ * Preview (--level) and coarse-to-fine (--progressive) runs
+ * every object image (and color plane) is halved level times with a 2x2 box filter, and the job is solved
+ * at that scale with the needle step shrunk to match; progressive runs solve each level from the coarsest
+ * down to full resolution, so the outputs first hold a coarse result that then gets refined
+ */
+void runJobAtLevels(const Job& job, const vector<Image>& images, const vector<Image>& color, StreamState* stream){
+    const int kDefaultProgressiveLevels = 3;
+    int coarsest = job.progressive && job.level == 0 ? kDefaultProgressiveLevels : job.level;
+
+    // don't go below 1 pixel
+    while (coarsest > 0 && (images[0].num_rows() >> coarsest == 0 || images[0].num_columns() >> coarsest == 0)){
+        coarsest--;
+    }
+    if (coarsest == 0){
+        runJob(job, images, color, stream);
+        return;
+    }
+
+    // levels[l - 1] holds every image at level l
+    vector<vector<Image>> levels(coarsest), color_levels(coarsest);
+    for (size_t k = 0; k < images.size(); k++){
+        vector<Image> pyramid;
+        BuildPyramid(images[k], coarsest, &pyramid);
+        for (int l = 0; l < coarsest; l++){
+            levels[l].push_back(pyramid[l]);
+        }
+    }
+    for (size_t c = 0; c < color.size(); c++){
+        vector<Image> pyramid;
+        BuildPyramid(color[c], coarsest, &pyramid);
+        for (int l = 0; l < coarsest; l++){
+            color_levels[l].push_back(pyramid[l]);
+        }
+    }
+
+    const int finest = job.progressive ? 0 : coarsest;
+    for (int l = coarsest; l >= finest; l--){
+        if (l == 0){
+            runJob(job, images, color, stream);
+        }
+        else{
+            Job level_job = job;
+            level_job.step = max(1, job.step >> l);
+            // streaming state only makes sense at one fixed scale
+            runJob(level_job, levels[l - 1], color_levels[l - 1], job.progressive ? nullptr : stream);
+        }
+        if (job.progressive){
+            printf("Progressive: level %d (%dx%d) written\n", l, (int)images[0].num_columns() >> l, (int)images[0].num_rows() >> l);
+        }
     }
-    if (!WriteImage(albedo_file, albedo_image)){
-        cout << "Can't write to file " << albedo_file << endl;
+}
+
+int main(int argc, char **argv){
+
+    // --batch {jobs file} runs every line of the file, any other arguments apply to all of them
+    vector<string> args(argv + 1, argv + argc);
+    vector<vector<string>> job_args;
+    // --pool-stats prints how often image buffers came from the pool, once at the end
+    auto pool_stats_arg = find(args.begin(), args.end(), "--pool-stats");
+    const bool pool_stats = pool_stats_arg != args.end();
+    if (pool_stats){
+        args.erase(pool_stats_arg);
+    }
+    auto batch = find(args.begin(), args.end(), "--batch");
+    if (batch != args.end() && batch + 1 != args.end()){
+        const string batch_file = *(batch + 1);
+        args.erase(batch, batch + 2);
+        job_args = readBatchFile(batch_file);
+        for (auto& line : job_args){
+            line.insert(line.end(), args.begin(), args.end());
+        }
+    }
+    else{
+        job_args.push_back(args);
+    }
+
+    vector<Job> jobs;
+    for (const auto& line : job_args){
+        Job job;
+        if (!parseJob(line, job)){
+            printf("Usage: %s {input directions or calibration cache} {object image 1} {object image 2} {object image 3} [... {object image N}] {step} {threshold} {output normals} {output albedo} [--fixed] [--check-error] [--color] [--level {L}] [--progressive] [--svg {needle map svg}]\n", argv[0]);
+            printf("       %s --uncalibrated {object image 1} {object image 2} {object image 3} [... {object image N}] {step} {threshold} {output normals} {output albedo} [--no-integrability]\n", argv[0]);
+            printf("       %s --batch {jobs file, one set of the above arguments per line} [--fixed] [--check-error] [--stream] [--stream-tolerance {sad}] [--pool-stats]\n", argv[0]);
+            return 0;
+        }
+        jobs.push_back(job);
+    }
+    if (jobs.empty()){
         return 0;
     }
-    
+
+    // uncalibrated lights are re-estimated for every frame set, so previous results never match them
+    bool stream_uncalibrated = false;
+    for (auto& job : jobs){
+        if (job.stream && job.uncalibrated){
+            job.stream = false;
+            stream_uncalibrated = true;
+        }
+    }
+    if (stream_uncalibrated){
+        cout << "--stream doesn't work with --uncalibrated, solving every frame set in full" << endl;
+    }
+
+    // Read object images: all images of a job load in parallel, and the next job's images load while this one is solved
+    vector<Image> images, color;
+    size_t failed = 0;
+    bool loaded = loadFrames(jobs[0], &images, &color, &failed);
+    StreamState stream;
+    size_t last_rows = 0, last_columns = 0;
+
+    for (size_t i = 0; i < jobs.size(); ++i){
+        // buffers cached for a different frame size won't be asked for again
+        if (loaded && i > 0 && (images[0].num_rows() != last_rows || images[0].num_columns() != last_columns)){
+            BufferPool::Global().Trim();
+        }
+
+        vector<Image> next_images, next_color;
+        size_t next_failed = 0;
+        future<bool> next_loaded;
+        if (i + 1 < jobs.size()){
+            next_loaded = async(launch::async, [&](){
+                return loadFrames(jobs[i + 1], &next_images, &next_color, &next_failed);
+            });
+        }
+
+        if (!loaded){
+            cout << "Can't open file " << jobs[i].object_files[failed] << endl;
+        }
+        else{
+            runJobAtLevels(jobs[i], images, color, jobs[i].stream ? &stream : nullptr);
+            last_rows = images[0].num_rows();
+            last_columns = images[0].num_columns();
+        }
+
+        if (next_loaded.valid()){
+            loaded = next_loaded.get();
+            failed = next_failed;
+            images.swap(next_images);
+            color.swap(next_color);
+        }
+    }
+
+    // after the first frame set, a batch of same-size frames should only hit the pool
+    if (pool_stats){
+        const BufferPool::Stats stats = BufferPool::Global().GetStats();
+        printf("Buffer pool: %zu hits, %zu misses, %zu bytes cached\n", stats.hits, stats.misses, stats.cached_bytes);
+    }
     
     return 0;
-}
\ No newline at end of file
+}